@@ -0,0 +1,111 @@
+#include "Benchmark.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+namespace {
+
+/**
+ * Nearest-rank percentile p (0..1) of the sorted samples.
+ */
+double percentile(const std::vector<double> &sorted, double p) {
+  size_t rank = std::ceil(p * sorted.size());
+  return sorted[rank ? rank - 1 : 0];
+}
+
+/**
+ * The string as a JSON string literal.
+ */
+std::string quoted(const std::string &s) {
+  std::string ret = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      ret += '\\';
+    }
+    ret += c;
+  }
+  return ret + "\"";
+}
+
+/**
+ * The string as a CSV field, only quoted if it has to be.
+ */
+std::string field(const std::string &s) {
+  if (s.find_first_of(",\"\n") == std::string::npos) {
+    return s;
+  }
+  std::string ret = "\"";
+  for (char c : s) {
+    if (c == '"') {
+      ret += '"';
+    }
+    ret += c;
+  }
+  return ret + "\"";
+}
+
+} // namespace
+
+Summary summarize(std::vector<double> samples) {
+  Summary s;
+  if (samples.empty()) {
+    return s;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  s.min = samples.front();
+  s.median = percentile(samples, 0.5);
+  s.p95 = percentile(samples, 0.95);
+  s.p99 = percentile(samples, 0.99);
+  return s;
+}
+
+Report::Report(Format format, std::ostream &out) : format(format), out(out) {
+  if (format == Format::CSV) {
+    out << "image,strategy,pixels,repetitions,min_us,median_us,p95_us,p99_us,"
+           "median_withprep_us,mpixels_per_s"
+        << std::endl;
+  } else if (format == Format::JSON) {
+    out << "[";
+  }
+}
+
+void Report::add(const std::string &image, const std::string &strategy,
+                 size_t pixels, const std::vector<double> &execute,
+                 const std::vector<double> &withprep) {
+  if (format == Format::Text) {
+    for (size_t i = 0; i < execute.size(); ++i) {
+      out << std::left << std::setw(32) << image << " -- " << std::setw(32)
+          << strategy << " -- " << std::setw(23) << (long)execute[i] << " -- "
+          << (long)withprep[i] << std::endl;
+    }
+    return;
+  }
+
+  Summary s = summarize(execute);
+  Summary prep = summarize(withprep);
+  // Pixels per microsecond is megapixels per second.
+  double mps = s.median > 0 ? pixels / s.median : 0;
+
+  if (format == Format::CSV) {
+    out << field(image) << "," << field(strategy) << "," << pixels << ","
+        << execute.size() << "," << s.min << "," << s.median << "," << s.p95
+        << "," << s.p99 << "," << prep.median << "," << mps << std::endl;
+    return;
+  }
+
+  out << (records ? ",\n " : "\n ") << "{\"image\": " << quoted(image)
+      << ", \"strategy\": " << quoted(strategy) << ", \"pixels\": " << pixels
+      << ", \"repetitions\": " << execute.size() << ", \"min_us\": " << s.min
+      << ", \"median_us\": " << s.median << ", \"p95_us\": " << s.p95
+      << ", \"p99_us\": " << s.p99
+      << ", \"median_withprep_us\": " << prep.median
+      << ", \"mpixels_per_s\": " << mps << "}";
+  ++records;
+}
+
+Report::~Report() {
+  if (format == Format::JSON) {
+    out << "\n]" << std::endl;
+  }
+}
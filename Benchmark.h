@@ -0,0 +1,54 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Order statistics of a set of timings, in microseconds.  The percentiles are
+ * nearest-rank, so always one of the samples.
+ */
+struct Summary {
+  double min = 0;
+  double median = 0;
+  double p95 = 0;
+  double p99 = 0;
+};
+
+Summary summarize(std::vector<double> samples);
+
+/**
+ * Writes the timings of every strategy on every image.  Text keeps the lines
+ * of the original tester, one per repetition, so gather.py still reads it.
+ * CSV and JSON give one summarized record per strategy and image, with the
+ * throughput in megapixels per second of the median execution.
+ */
+class Report {
+public:
+  enum class Format { Text, CSV, JSON };
+
+private:
+  Format format;
+  std::ostream &out;
+  size_t records = 0;
+
+public:
+  Report(Format format, std::ostream &out = std::cout);
+
+  /**
+   * Adds the timings of one strategy on one image of the given number of
+   * pixels.  execute holds the time of the labeling alone for every
+   * repetition, withprep that including the transfers to and from it.
+   */
+  void add(const std::string &image, const std::string &strategy,
+           size_t pixels, const std::vector<double> &execute,
+           const std::vector<double> &withprep);
+
+  /**
+   * Closes the JSON array.
+   */
+  ~Report();
+};
+
+#endif /* end of include guard: BENCHMARK_H */
@@ -0,0 +1,43 @@
+#include "Equivalence.h"
+
+LABELTYPE Equivalence::add(size_t n) {
+  LABELTYPE offset = size();
+  for (size_t i = 1; i <= n; ++i) {
+    parent.push_back(offset + i);
+  }
+  return offset;
+}
+
+LABELTYPE Equivalence::find(LABELTYPE label) {
+  // Path halving, every other node is pointed to its grandparent.
+  while (parent[label] != label) {
+    parent[label] = parent[parent[label]];
+    label = parent[label];
+  }
+  return label;
+}
+
+void Equivalence::unite(LABELTYPE a, LABELTYPE b) {
+  if (!a || !b) {
+    return;
+  }
+  a = find(a);
+  b = find(b);
+  if (a < b) {
+    parent[b] = a;
+  } else if (b < a) {
+    parent[a] = b;
+  }
+}
+
+std::vector<LABELTYPE> Equivalence::resolve(size_t *count) {
+  std::vector<LABELTYPE> table(parent.size(), 0);
+  LABELTYPE next = 0;
+  // A root is smaller than the rest of its set, so it is always seen first.
+  for (size_t i = 1; i < parent.size(); ++i) {
+    LABELTYPE root = find(i);
+    table[i] = root == (LABELTYPE)i ? ++next : table[root];
+  }
+  *count = next;
+  return table;
+}
@@ -0,0 +1,42 @@
+#ifndef EQUIVALENCE_H
+#define EQUIVALENCE_H
+
+#include <vector>
+#include "defines.h"
+
+/**
+ * Union-find over provisional labels 1..size(), for merging labelings that
+ * were made separately, such as strips of an image.  The root of every set is
+ * its smallest label.
+ */
+class Equivalence {
+private:
+  // parent[0] is the background and never used.
+  std::vector<LABELTYPE> parent;
+
+public:
+  Equivalence() : parent(1, 0){};
+
+  /**
+   * Adds n labels, each in a set of its own.  Returns the offset that turns
+   * labels 1..n into the new ones.
+   */
+  LABELTYPE add(size_t n);
+
+  LABELTYPE find(LABELTYPE label);
+
+  /**
+   * Hooks the larger of the two roots onto the smaller, 0 is ignored.
+   */
+  void unite(LABELTYPE a, LABELTYPE b);
+
+  size_t size() const { return parent.size() - 1; }
+
+  /**
+   * Table from every provisional label to its final label, 1..count numbered
+   * in order of the smallest label of each set, and 0 for 0.
+   */
+  std::vector<LABELTYPE> resolve(size_t *count);
+};
+
+#endif /* end of include guard: EQUIVALENCE_H */
@@ -0,0 +1,186 @@
+#include "Generators.h"
+#include <algorithm>
+#include <random>
+
+namespace gen {
+
+namespace {
+
+// Fixed, so every run benchmarks the same input.
+const unsigned seed = 12345;
+
+/**
+ * A w*h LabelData of only background.
+ */
+LabelData empty(size_t w, size_t h) {
+  LabelData l(w, h);
+  l.clear();
+  return l;
+}
+
+} // namespace
+
+LabelData noise(size_t w, size_t h, double density) {
+  LabelData l(w, h);
+  std::mt19937 rng(seed);
+  std::bernoulli_distribution coin(density);
+  for (size_t i = 0; i < w * h; ++i) {
+    l.data[i] = coin(rng);
+  }
+  return l;
+}
+
+LabelData spiral(size_t w, size_t h) {
+  LabelData l = empty(w, h);
+  if (!w || !h) {
+    return l;
+  }
+
+  // Right, down, left, up.
+  const int dx[] = {1, 0, -1, 0};
+  const int dy[] = {0, 1, 0, -1};
+  auto d = l.data;
+  auto inside = [&](long x, long y) {
+    return x >= 0 && y >= 0 && x < (long)w && y < (long)h;
+  };
+  // The step ahead is free if it, and the one after it, aren't on the path,
+  // which leaves a pixel of background towards the previous turn.
+  auto free = [&](long x, long y, int dir) {
+    long nx = x + dx[dir];
+    long ny = y + dy[dir];
+    if (!inside(nx, ny) || d[w * ny + nx]) {
+      return false;
+    }
+    long fx = nx + dx[dir];
+    long fy = ny + dy[dir];
+    return !inside(fx, fy) || !d[w * fy + fx];
+  };
+
+  long x = 0;
+  long y = 0;
+  int dir = 0;
+  d[0] = 1;
+  while (true) {
+    if (!free(x, y, dir)) {
+      dir = (dir + 1) % 4;
+      if (!free(x, y, dir)) {
+        break;
+      }
+    }
+    x += dx[dir];
+    y += dy[dir];
+    d[w * y + x] = 1;
+  }
+  return l;
+}
+
+LabelData serpentine(size_t w, size_t h) {
+  LabelData l = empty(w, h);
+  for (size_t y = 0; y < h; ++y) {
+    if (y % 2 == 0) {
+      std::fill(l.data + w * y, l.data + w * (y + 1), 1);
+    } else if (w) {
+      // Joins the rows above and below, at alternating ends.
+      l.data[w * y + (y / 2 % 2 ? 0 : w - 1)] = 1;
+    }
+  }
+  return l;
+}
+
+LabelData checkerboard(size_t w, size_t h, size_t cell) {
+  cell = std::max<size_t>(cell, 1);
+  LabelData l(w, h);
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      l.data[w * y + x] = (x / cell + y / cell) % 2 == 0;
+    }
+  }
+  return l;
+}
+
+LabelData stripes(size_t w, size_t h, size_t width) {
+  width = std::max<size_t>(width, 1);
+  LabelData l(w, h);
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      l.data[w * y + x] = x / width % 2 == 0;
+    }
+  }
+  return l;
+}
+
+LabelData blobs(size_t w, size_t h, size_t count) {
+  LabelData l = empty(w, h);
+  if (!w || !h) {
+    return l;
+  }
+
+  std::mt19937 rng(seed);
+  const long maxr = std::max<long>(std::min(w, h) / 8, 1);
+  std::uniform_int_distribution<long> rx(0, w - 1);
+  std::uniform_int_distribution<long> ry(0, h - 1);
+  std::uniform_int_distribution<long> rr(1, maxr);
+  for (size_t i = 0; i < count; ++i) {
+    long cx = rx(rng);
+    long cy = ry(rng);
+    long r = rr(rng);
+    for (long y = std::max(cy - r, 0L); y <= std::min(cy + r, (long)h - 1);
+         ++y) {
+      for (long x = std::max(cx - r, 0L); x <= std::min(cx + r, (long)w - 1);
+           ++x) {
+        if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r) {
+          l.data[w * y + x] = 1;
+        }
+      }
+    }
+  }
+  return l;
+}
+
+bool is_spec(const std::string &name) {
+  return name.compare(0, 4, "gen:") == 0;
+}
+
+LabelData generate(const std::string &spec) {
+  // gen:kind:WxH[:param]
+  auto kindend = spec.find(':', 4);
+  if (!is_spec(spec) || kindend == std::string::npos) {
+    fail("Malformed generator " + spec + ", expected gen:kind:WxH[:param].");
+  }
+  std::string kind = spec.substr(4, kindend - 4);
+  auto sizeend = spec.find(':', kindend + 1);
+  std::string size = spec.substr(kindend + 1, sizeend - kindend - 1);
+  std::string param =
+      sizeend == std::string::npos ? "" : spec.substr(sizeend + 1);
+
+  size_t w = 0;
+  size_t h = 0;
+  auto x = size.find('x');
+  try {
+    if (x == std::string::npos) {
+      throw std::invalid_argument(size);
+    }
+    w = std::stoul(size.substr(0, x));
+    h = std::stoul(size.substr(x + 1));
+    if (kind == "noise") {
+      return noise(w, h, param.empty() ? 0.5 : std::stod(param));
+    } else if (kind == "spiral") {
+      return spiral(w, h);
+    } else if (kind == "serpentine") {
+      return serpentine(w, h);
+    } else if (kind == "checkerboard") {
+      return checkerboard(w, h, param.empty() ? 1 : std::stoul(param));
+    } else if (kind == "stripes") {
+      return stripes(w, h, param.empty() ? 1 : std::stoul(param));
+    } else if (kind == "blobs") {
+      return blobs(w, h, param.empty() ? 16 : std::stoul(param));
+    }
+  } catch (const std::logic_error &) {
+    fail("Malformed generator " + spec + ", expected gen:kind:WxH[:param].");
+  }
+  fail("Unknown generator " + kind + ", expected one of noise, spiral, "
+       "serpentine, checkerboard, stripes and blobs.");
+  return LabelData();
+}
+
+} // namespace gen
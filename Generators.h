@@ -0,0 +1,64 @@
+#ifndef GENERATORS_H
+#define GENERATORS_H
+
+#include <string>
+#include "LabelData.h"
+
+/**
+ * Synthetic binary inputs of any size, made directly as LabelData with 1 for
+ * foreground, so they can be scaled without going through png files.  All
+ * are deterministic, the random ones use a fixed seed.
+ */
+namespace gen {
+
+/**
+ * Every pixel foreground with probability density.
+ */
+LabelData noise(size_t w, size_t h, double density = 0.5);
+
+/**
+ * A single path, one pixel wide, spiraling inwards from the corner with a
+ * pixel of background between the turns.  Its labels have to travel the
+ * whole length of the path, the worst case for the propagating strategies.
+ */
+LabelData spiral(size_t w, size_t h);
+
+/**
+ * Full rows on every other line, joined alternately at the right and left
+ * end into one long path going back and forth.
+ */
+LabelData serpentine(size_t w, size_t h);
+
+/**
+ * Squares of cell*cell pixels alternating foreground and background.  With
+ * cell 1 and 4-connectivity every foreground pixel is its own component.
+ */
+LabelData checkerboard(size_t w, size_t h, size_t cell = 1);
+
+/**
+ * Vertical stripes of the given width, alternating foreground and background.
+ */
+LabelData stripes(size_t w, size_t h, size_t width = 1);
+
+/**
+ * count filled disks of random position and size, up to an eighth of the
+ * smaller side in radius.
+ */
+LabelData blobs(size_t w, size_t h, size_t count = 16);
+
+/**
+ * Whether name is a generator spec rather than a file, see generate.
+ */
+bool is_spec(const std::string &name);
+
+/**
+ * The input described by a spec of the form gen:kind:WxH[:param], where kind
+ * is one of the generators above and param its last argument, if it has one.
+ * For example gen:noise:4096x4096:0.3 or gen:spiral:1024x1024.  Fails on an
+ * unknown kind or malformed size.
+ */
+LabelData generate(const std::string &spec);
+
+} // namespace gen
+
+#endif /* end of include guard: GENERATORS_H */
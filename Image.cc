@@ -196,3 +196,174 @@ bool iml::writepng(const std::string &filename, size_t width, size_t height,
 }
 
 Image::~Image() { delete[] data; }
+
+RowReader::RowReader(const std::string &filename) {
+  fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    std::cerr << "Couldn't open image file." << std::endl;
+    return;
+  }
+
+  pngp =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  if (!pngp) {
+    std::cerr << "Couldn't create png struct" << std::endl;
+    return;
+  }
+
+  pngi = png_create_info_struct(pngp);
+  if (!pngi) {
+    std::cerr << "Couldn't create png/info struct" << std::endl;
+    return;
+  }
+
+  if (setjmp(png_jmpbuf(pngp))) {
+    return;
+  }
+
+  png_init_io(pngp, fp);
+  png_read_info(pngp, pngi);
+
+  _height = png_get_image_height(pngp, pngi);
+  _width = png_get_image_width(pngp, pngi);
+  if (_height <= 0 || _width <= 0) {
+    std::cerr << "Found no image data, zero dimension" << std::endl;
+    return;
+  }
+  if (png_get_interlace_type(pngp, pngi) != PNG_INTERLACE_NONE) {
+    std::cerr << "Interlaced images can't be read by row" << std::endl;
+    return;
+  }
+
+  // Same expansions as Image::loadpng.
+  int bit_depth = png_get_bit_depth(pngp, pngi);
+  int color_type = png_get_color_type(pngp, pngi);
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb(pngp);
+  }
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+    png_set_expand_gray_1_2_4_to_8(pngp);
+  }
+  if (png_get_valid(pngp, pngi, PNG_INFO_tRNS)) {
+    png_set_tRNS_to_alpha(pngp);
+  }
+  if (color_type == PNG_COLOR_TYPE_RGB) {
+    png_set_filler(pngp, 255, PNG_FILLER_BEFORE);
+  }
+  if (bit_depth == 16) {
+    png_set_strip_16(pngp);
+  }
+  png_read_update_info(pngp, pngi);
+
+  channels = png_get_channels(pngp, pngi);
+  raw = new unsigned char[png_get_rowbytes(pngp, pngi)];
+  ok = true;
+}
+
+bool RowReader::read_row(unsigned char *rgba) {
+  if (!ok) {
+    return false;
+  }
+  if (setjmp(png_jmpbuf(pngp))) {
+    ok = false;
+    return false;
+  }
+
+  png_read_row(pngp, raw, nullptr);
+
+  // Expand what is left to RGBA, as Image::loadpng does.
+  auto *in = raw;
+  auto *out = rgba;
+  for (size_t x = 0; x < _width; ++x) {
+    if (channels == 1) {
+      out[0] = in[0];
+      out[1] = in[0];
+      out[2] = in[0];
+      out[3] = 255;
+    } else if (channels == 2) {
+      out[0] = in[0];
+      out[1] = in[0];
+      out[2] = in[0];
+      out[3] = in[1];
+    } else if (channels == 3) {
+      out[0] = in[0];
+      out[1] = in[1];
+      out[2] = in[2];
+      out[3] = 255;
+    } else {
+      out[0] = in[0];
+      out[1] = in[1];
+      out[2] = in[2];
+      out[3] = in[3];
+    }
+    in += channels;
+    out += 4;
+  }
+  return true;
+}
+
+RowReader::~RowReader() {
+  if (pngp) {
+    png_destroy_read_struct(&pngp, pngi ? &pngi : (png_infopp)0,
+                            (png_infopp)0);
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  delete[] raw;
+}
+
+RowWriter::RowWriter(const std::string &filename, size_t width, size_t height)
+    : rows_left(height) {
+  fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    return;
+  }
+
+  pngp =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  if (!pngp) {
+    return;
+  }
+  pngi = png_create_info_struct(pngp);
+  if (!pngi) {
+    return;
+  }
+
+  if (setjmp(png_jmpbuf(pngp))) {
+    return;
+  }
+
+  png_init_io(pngp, fp);
+  png_set_IHDR(pngp, pngi, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+               PNG_FILTER_TYPE_BASE);
+  png_write_info(pngp, pngi);
+  ok = true;
+}
+
+bool RowWriter::write_row(unsigned char *rgba) {
+  if (!ok || rows_left == 0) {
+    return false;
+  }
+  if (setjmp(png_jmpbuf(pngp))) {
+    ok = false;
+    return false;
+  }
+
+  png_write_row(pngp, rgba);
+  --rows_left;
+  return true;
+}
+
+RowWriter::~RowWriter() {
+  if (ok && rows_left == 0 && !setjmp(png_jmpbuf(pngp))) {
+    png_write_end(pngp, NULL);
+  }
+  if (pngp) {
+    png_destroy_write_struct(&pngp, pngi ? &pngi : (png_infopp)NULL);
+  }
+  if (fp) {
+    fclose(fp);
+  }
+}
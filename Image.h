@@ -51,6 +51,88 @@ public:
   operator bool() { return ok; }
 };
 
+/**
+ * Reads a png one row at a time, for images too large to load at once.
+ * Rows are expanded to 8 bit RGBA like Image does.  Interlaced images need
+ * every row at once and are not supported.
+ */
+class RowReader {
+private:
+  FILE *fp = nullptr;
+  png_structp pngp = nullptr;
+  png_infop pngi = nullptr;
+  bool ok = false;
+  size_t _width = 0;
+  size_t _height = 0;
+  int channels = 0;
+  // A row as libpng gives it, before expanding to RGBA.
+  unsigned char *raw = nullptr;
+
+  RowReader(RowReader const &rhs) = delete;
+  RowReader(RowReader &&rhs) = delete;
+  RowReader &operator=(RowReader const &rhs) noexcept = delete;
+  RowReader &operator=(RowReader &&rhs) noexcept = delete;
+
+public:
+  /**
+   * Opens the file and reads the header.
+   * Check if ok before using by a bool conversion.
+   */
+  RowReader(const std::string &filename);
+
+  /**
+   * Closes the file.
+   */
+  ~RowReader();
+
+  /**
+   * Reads the next row into rgba, which must hold width*4 bytes.
+   */
+  bool read_row(unsigned char *rgba);
+
+  size_t width() { return _width; }
+  size_t height() { return _height; }
+
+  operator bool() { return ok; }
+};
+
+/**
+ * Writes an 8 bit RGBA png one row at a time.  The file is finished when
+ * every row has been written and the writer is destroyed.
+ */
+class RowWriter {
+private:
+  FILE *fp = nullptr;
+  png_structp pngp = nullptr;
+  png_infop pngi = nullptr;
+  bool ok = false;
+  size_t rows_left = 0;
+
+  RowWriter(RowWriter const &rhs) = delete;
+  RowWriter(RowWriter &&rhs) = delete;
+  RowWriter &operator=(RowWriter const &rhs) noexcept = delete;
+  RowWriter &operator=(RowWriter &&rhs) noexcept = delete;
+
+public:
+  /**
+   * Creates the file and writes the header.
+   * Check if ok before using by a bool conversion.
+   */
+  RowWriter(const std::string &filename, size_t width, size_t height);
+
+  /**
+   * Finishes and closes the file.
+   */
+  ~RowWriter();
+
+  /**
+   * Writes the next row of width*4 bytes.
+   */
+  bool write_row(unsigned char *rgba);
+
+  operator bool() { return ok; }
+};
+
 /**
  * Writes the data to a png.
  * Can't const data due to libpng, but it shouldn't be edited.
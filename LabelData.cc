@@ -1,4 +1,5 @@
 #include "LabelData.h"
+#include <algorithm>
 
 LabelData::LabelData(iml::Image *img, bool (*threshold_function)(
                                           unsigned char r, unsigned char g,
@@ -109,7 +110,7 @@ bool equivalent_result(LabelData *a, LabelData *b) {
   return true;
 }
 
-bool valid_result(LabelData *l) {
+bool valid_result(LabelData *l, int connectivity, bool compact) {
   auto w = l->width;
   auto h = l->height;
   const LABELTYPE *d = l->data;
@@ -122,7 +123,7 @@ bool valid_result(LabelData *l) {
         std::cerr << "Labelnr above 1 << 24!" << std::endl;
       }
 
-      if (curlabel == 1) {
+      if (curlabel == 1 && !compact) {
         std::cerr << "Unlabeled pixel at x:" << x << " y:" << y << std::endl;
         return false;
       }
@@ -137,6 +138,20 @@ bool valid_result(LabelData *l) {
                       d[w * (y + 1) + (x)] != curlabel;
         closefault |= y - 1 < h && d[w * (y - 1) + (x)] != 0 &&
                       d[w * (y - 1) + (x)] != curlabel;
+        if (connectivity == 8) {
+          closefault |= x + 1 < w && y + 1 < h &&
+                        d[w * (y + 1) + (x + 1)] != 0 &&
+                        d[w * (y + 1) + (x + 1)] != curlabel;
+          closefault |= x - 1 < w && y + 1 < h &&
+                        d[w * (y + 1) + (x - 1)] != 0 &&
+                        d[w * (y + 1) + (x - 1)] != curlabel;
+          closefault |= x + 1 < w && y - 1 < h &&
+                        d[w * (y - 1) + (x + 1)] != 0 &&
+                        d[w * (y - 1) + (x + 1)] != curlabel;
+          closefault |= x - 1 < w && y - 1 < h &&
+                        d[w * (y - 1) + (x - 1)] != 0 &&
+                        d[w * (y - 1) + (x - 1)] != curlabel;
+        }
 
         if (closefault) {
           std::cerr << "Connected components with different labels at x:" << x
@@ -149,12 +164,13 @@ bool valid_result(LabelData *l) {
 
   LabelData tmp(*l);
   std::set<LABELTYPE> prev;
+  LABELTYPE next = 1;
   for (size_t y = 0; y < h; ++y) {
     for (size_t x = 0; x < w; ++x) {
       auto curlabel = tmp.data[w * y + x];
 
       // Only do anything if it's some component
-      if (curlabel > 1) {
+      if (curlabel > 1 || (compact && curlabel == 1)) {
         // Another component already used the label
         if (prev.count(curlabel)) {
           std::cerr << "Multiple components with same label: " << curlabel
@@ -162,18 +178,107 @@ bool valid_result(LabelData *l) {
           return false;
         }
 
+        if (compact && curlabel != next++) {
+          std::cerr << "Label " << curlabel << " out of order, expected "
+                    << next - 1 << std::endl;
+          return false;
+        }
+
         // Record that this component uses this label
         prev.insert(curlabel);
 
         // Set to zero to ignore this component in next iteration
-        mark_explore(x, y, &tmp, curlabel, 0);
+        if (connectivity == 8) {
+          mark_explore<8>(x, y, &tmp, curlabel, 0);
+        } else {
+          mark_explore<4>(x, y, &tmp, curlabel, 0);
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+std::vector<ComponentStats> component_stats(const LabelData *l,
+                                            size_t count) {
+  auto w = l->width;
+  auto h = l->height;
+  const LABELTYPE *d = l->data;
+
+  std::vector<ComponentStats> stats(count);
+  std::vector<size_t> sumx(count, 0);
+  std::vector<size_t> sumy(count, 0);
+  std::map<LABELTYPE, size_t> index;
+  for (size_t i = 0; i < count; ++i) {
+    stats[i] = {(LABELTYPE)(i + 1), 0, w, h, 0, 0, 0, 0};
+  }
+
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      auto curlabel = d[w * y + x];
+      if (!curlabel) {
+        continue;
       }
+
+      size_t i;
+      if (count) {
+        i = curlabel - 1;
+      } else {
+        auto it = index.find(curlabel);
+        if (it == index.end()) {
+          it = index.emplace(curlabel, stats.size()).first;
+          stats.push_back({curlabel, 0, w, h, 0, 0, 0, 0});
+          sumx.push_back(0);
+          sumy.push_back(0);
+        }
+        i = it->second;
+      }
+
+      auto &s = stats[i];
+      s.area += 1;
+      s.xmin = std::min(s.xmin, x);
+      s.ymin = std::min(s.ymin, y);
+      s.xmax = std::max(s.xmax, x);
+      s.ymax = std::max(s.ymax, y);
+      sumx[i] += x;
+      sumy[i] += y;
+    }
+  }
+
+  for (size_t i = 0; i < stats.size(); ++i) {
+    if (stats[i].area) {
+      stats[i].cx = (double)sumx[i] / stats[i].area;
+      stats[i].cy = (double)sumy[i] / stats[i].area;
+    }
+  }
+
+  return stats;
+}
+
+bool equivalent_stats(const std::vector<ComponentStats> &a,
+                      const std::vector<ComponentStats> &b) {
+  if (a.size() != b.size()) {
+    std::cerr << "Mismatched number of components" << std::endl;
+    return false;
+  }
+
+  for (size_t i = 0; i < a.size(); ++i) {
+    auto &sa = a[i];
+    auto &sb = b[i];
+    if (sa.area != sb.area || sa.xmin != sb.xmin || sa.ymin != sb.ymin ||
+        sa.xmax != sb.xmax || sa.ymax != sb.ymax || sa.cx != sb.cx ||
+        sa.cy != sb.cy) {
+      std::cerr << "Mismatched statistics for component " << i + 1
+                << std::endl;
+      return false;
     }
   }
 
   return true;
 }
 
+template <int CONN>
 void mark_explore(size_t xinit, size_t yinit, LabelData *l, LABELTYPE from,
                   LABELTYPE to) {
   auto w = l->width;
@@ -209,5 +314,21 @@ void mark_explore(size_t xinit, size_t yinit, LabelData *l, LABELTYPE from,
       d[w * (y - 1) + x] = to;
       xys.emplace_back(x, y - 1);
     }
+    if (CONN == 8) {
+      for (size_t ny = y - 1; ny != y + 3; ny += 2) {
+        for (size_t nx = x - 1; nx != x + 3; nx += 2) {
+          // Wraps around for -1, and is then caught as out of range
+          if (nx < w && ny < h && d[w * ny + nx] == from) {
+            d[w * ny + nx] = to;
+            xys.emplace_back(nx, ny);
+          }
+        }
+      }
+    }
   }
 }
+
+template void mark_explore<4>(size_t, size_t, LabelData *, LABELTYPE,
+                              LABELTYPE);
+template void mark_explore<8>(size_t, size_t, LabelData *, LABELTYPE,
+                              LABELTYPE);
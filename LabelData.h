@@ -68,6 +68,11 @@ public:
 //   UTILITY concerning labeldatas   //
 ///////////////////////////////////////
 
+/**
+ * Changes the label of every pixel connected to (x, y) with label from, into
+ * to.  CONN is the connectivity, 4 or 8.
+ */
+template <int CONN = 4>
 void mark_explore(size_t x, size_t y, LabelData *l, LABELTYPE from,
                   LABELTYPE to);
 
@@ -79,8 +84,36 @@ void mark_explore(size_t x, size_t y, LabelData *l, LABELTYPE from,
 bool equivalent_result(LabelData *a, LabelData *b);
 
 /**
- * Checks for internal consistency of component labeling.
+ * Checks for internal consistency of component labeling, with the given
+ * connectivity (4 or 8).  A compact labeling, as left by Strategy::relabel,
+ * must also number its components 1..N in raster order, so 1 is a label there
+ * rather than an unlabeled pixel.
+ */
+bool valid_result(LabelData *l, int connectivity = 4, bool compact = false);
+
+/**
+ * Area, inclusive bounding box and centroid of a single component.
+ */
+struct ComponentStats {
+  LABELTYPE label;
+  size_t area;
+  size_t xmin, ymin, xmax, ymax;
+  double cx, cy;
+};
+
+/**
+ * Statistics of every component, in raster order of their first pixel.  If
+ * count is given the labels are taken to already be compact, 1..count as left
+ * by Strategy::relabel, and are indexed directly instead of through a map.
+ */
+std::vector<ComponentStats> component_stats(const LabelData *l,
+                                            size_t count = 0);
+
+/**
+ * Whether the two hold the same statistics, printing the first difference.
+ * The labels themselves are not compared.
  */
-bool valid_result(LabelData *l);
+bool equivalent_stats(const std::vector<ComponentStats> &a,
+                      const std::vector<ComponentStats> &b);
 
 #endif /* end of include guard: LABELDATA_H */
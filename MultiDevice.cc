@@ -0,0 +1,151 @@
+#include "MultiDevice.h"
+#include <algorithm>
+#include <thread>
+#include "Equivalence.h"
+#include "utilityCL.h"
+
+MultiDevice::MultiDevice(const std::function<GPUBase *()> &make)
+    : make(make), strat_name(std::unique_ptr<GPUBase>(make())->name()) {}
+
+void MultiDevice::setup(cl::Context *c, cl::Program *p) {
+  devices = c->getInfo<CL_CONTEXT_DEVICES>();
+  context = *c;
+  program = *p;
+  std::string options;
+  p->getBuildInfo(devices[0], CL_PROGRAM_BUILD_OPTIONS, &options);
+
+  if (devices.size() == 1) {
+    // A handful of equal sub-devices, as many bands as that makes.
+    const size_t wanted = 4;
+    cl_uint units = devices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    cl_uint subs_max =
+        devices[0].getInfo<CL_DEVICE_PARTITION_MAX_SUB_DEVICES>();
+    if (units >= 2 && subs_max >= 2) {
+      cl_device_partition_property props[] = {
+          CL_DEVICE_PARTITION_EQUALLY,
+          (cl_device_partition_property)std::max<cl_uint>(units / wanted, 1),
+          0};
+      std::vector<cl::Device> subs;
+      if (!devices[0].createSubDevices(props, &subs) && subs.size() > 1) {
+        devices = subs;
+        cl_int err;
+        context = cl::Context(devices, nullptr, nullptr, nullptr, &err);
+        if (err) {
+          fail("Couldn't create a context for the sub-devices.", err);
+        }
+        program = load_cl_program(&context, &devices[0], options);
+      }
+    }
+  }
+
+  queues.clear();
+  strats.clear();
+  for (auto &device : devices) {
+    queues.push_back(load_queue(&context, &device));
+    strats.emplace_back(make());
+  }
+  variants.reset(
+      new ProgramVariants(&context, &devices[0], &program, options));
+  parent = c;
+  parent_program = p;
+}
+
+void MultiDevice::copy_to(const LabelData *in, cl::Context *c, cl::Program *p,
+                          cl::CommandQueue *q) {
+  if (parent != c || parent_program != p) {
+    setup(c, p);
+  }
+  CPUBase::copy_to(in, c, p, q);
+
+  const size_t w = l.width;
+  const size_t h = l.height;
+  const size_t n = std::max<size_t>(std::min(strats.size(), h), 1);
+  const size_t rows = (h + n - 1) / n;
+
+  first_rows.clear();
+  bands.clear();
+  for (size_t y = 0; y < h; y += rows) {
+    // Every band but the first starts with the last row of the one above.
+    size_t top = y ? y - 1 : 0;
+    size_t bottom = std::min(y + rows, h);
+    LabelData band(w, bottom - top);
+    std::copy(l.data + w * top, l.data + w * bottom, band.data);
+    first_rows.push_back(y);
+    bands.push_back(std::move(band));
+  }
+
+  // The settings may change between runs, unlike the devices.
+  for (size_t i = 0; i < bands.size(); ++i) {
+    strats[i]->convergence = convergence;
+    strats[i]->transfer = transfer;
+    strats[i]->tuning = tuning;
+    strats[i]->variants = nullptr;
+    if (specialise) {
+      variants->add(w, bands[i].height);
+      strats[i]->variants = variants.get();
+    }
+    strats[i]->copy_to(&bands[i], &context, &program, &queues[i]);
+  }
+}
+
+void MultiDevice::execute() {
+  const size_t w = l.width;
+  const size_t n = bands.size();
+
+  // Compact labels per band, so they can be stacked in one Equivalence.
+  std::vector<size_t> counts(n);
+  std::vector<std::thread> pool;
+  for (size_t i = 0; i < n; ++i) {
+    pool.emplace_back([&, i] {
+      strats[i]->execute();
+      counts[i] = strats[i]->relabel();
+      bands[i] = strats[i]->copy_from();
+    });
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+
+  Equivalence eq;
+  std::vector<LABELTYPE> offsets(n);
+  for (size_t i = 0; i < n; ++i) {
+    offsets[i] = eq.add(counts[i]);
+  }
+
+  // The halo row of a band is the last row of the band above, labeled by
+  // both.
+  for (size_t i = 1; i < n; ++i) {
+    const LABELTYPE *halo = bands[i].data;
+    const LABELTYPE *above =
+        bands[i - 1].data + w * (bands[i - 1].height - 1);
+    for (size_t x = 0; x < w; ++x) {
+      if (halo[x]) {
+        eq.unite(offsets[i] + halo[x], offsets[i - 1] + above[x]);
+      }
+    }
+  }
+
+  size_t count;
+  std::vector<LABELTYPE> table = eq.resolve(&count);
+
+  // Back to the index+2 of the first pixel of every component, as the gpu
+  // strategies leave them.
+  std::vector<LABELTYPE> first(count + 1, 0);
+  for (size_t i = 0; i < n; ++i) {
+    const size_t skip = i ? 1 : 0;
+    const LABELTYPE *in = bands[i].data + w * skip;
+    LABELTYPE *out = l.data + w * first_rows[i];
+    const size_t size = w * (bands[i].height - skip);
+    for (size_t j = 0; j < size; ++j) {
+      if (!in[j]) {
+        out[j] = 0;
+        continue;
+      }
+      LABELTYPE label = table[offsets[i] + in[j]];
+      if (!first[label]) {
+        first[label] = (out - l.data) + j + 2;
+      }
+      out[j] = first[label];
+    }
+  }
+}
@@ -0,0 +1,69 @@
+#ifndef MULTIDEVICE_H
+#define MULTIDEVICE_H
+
+#include <memory>
+#include "Strategy.h"
+
+/**
+ * Labels an image split into bands of rows over every device of the context,
+ * or, if it has only one, over sub-devices of it made by device fission.
+ * Every band is labeled by its own gpu strategy from make, on its own thread,
+ * together with the last row of the band above as halo.  The halo rows tell
+ * which labels of neighbouring bands belong together, and the bands are
+ * merged with an Equivalence on the host.  The result is kept in host memory,
+ * so relabel and statistics are those of CPUBase.
+ */
+class MultiDevice : public CPUBase {
+private:
+  std::function<GPUBase *()> make;
+  std::string strat_name;
+
+  // The context and program the devices were set up for, and what they run
+  // with.
+  cl::Context *parent = nullptr;
+  cl::Program *parent_program = nullptr;
+  cl::Context context;
+  cl::Program program;
+  std::vector<cl::Device> devices;
+  std::vector<cl::CommandQueue> queues;
+  std::vector<std::unique_ptr<GPUBase>> strats;
+  // Of program, for the sizes of the bands, when specialise is set.
+  std::unique_ptr<ProgramVariants> variants;
+
+  // Per band, its first row in the image and its input including the halo.
+  std::vector<size_t> first_rows;
+  std::vector<LabelData> bands;
+
+  /**
+   * Finds the devices, splitting a single one if it allows, and builds the
+   * program for them with the options p was built with.
+   */
+  void setup(cl::Context *c, cl::Program *p);
+
+public:
+  /**
+   * Passed on to the strategy of every band, see GPUBase.
+   */
+  GPUBase::Convergence convergence = GPUBase::Convergence::Batched;
+  GPUBase::Transfer transfer = GPUBase::Transfer::Auto;
+  Tuning *tuning = nullptr;
+
+  /**
+   * Whether the bands run with the program built for their size, see
+   * ProgramVariants.  The variants are built for the devices of the bands.
+   */
+  bool specialise = false;
+
+  /**
+   * make creates one of the strategies to use, and is called once per
+   * device.
+   */
+  explicit MultiDevice(const std::function<GPUBase *()> &make);
+
+  virtual std::string name() { return "Multi-device " + strat_name; }
+  virtual void copy_to(const LabelData *, cl::Context *, cl::Program *,
+                       cl::CommandQueue *);
+  virtual void execute();
+};
+
+#endif /* end of include guard: MULTIDEVICE_H */
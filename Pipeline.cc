@@ -0,0 +1,62 @@
+#include "Pipeline.h"
+#include <chrono>
+#include "utilityCL.h"
+
+Pipeline::Pipeline(const std::function<GPUBase *()> &make,
+                   cl::Context *context, cl::Device *device,
+                   cl::Program *program)
+    : context(context), program(program),
+      upload_queue(load_queue(context, device)),
+      compute_queue(load_queue(context, device)),
+      download_queue(load_queue(context, device)) {
+  for (auto &strat : strats) {
+    strat.reset(make());
+  }
+}
+
+double Pipeline::run(
+    const std::vector<const LabelData *> &frames,
+    const std::function<void(size_t, const LabelData &)> &done) {
+  const size_t n = frames.size();
+
+  // Hands out the frame downloaded in its slot, once it is there.
+  auto finish = [&](size_t frame) {
+    size_t slot = frame % slots;
+    downloaded[slot].wait();
+    if (done) {
+      done(frame, results[slot]);
+    }
+  };
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // Step i uploads frame i and downloads frame i-2, and then computes frame
+  // i-1 while those transfers are under way.
+  for (size_t i = 0; i < n + 2; ++i) {
+    if (i < n) {
+      size_t slot = i % slots;
+      // The slot was last used by frame i-3, which has to be out first.
+      if (i >= slots) {
+        finish(i - slots);
+      }
+      strats[slot]->upload(frames[i], context, program, &compute_queue,
+                           &upload_queue, &uploaded[slot]);
+    }
+    if (i >= 2) {
+      size_t slot = (i - 2) % slots;
+      strats[slot]->download(&results[slot], &download_queue,
+                             &downloaded[slot]);
+    }
+    if (i >= 1 && i <= n) {
+      strats[(i - 1) % slots]->execute();
+    }
+  }
+
+  for (size_t frame = n > slots ? n - slots : 0; frame < n; ++frame) {
+    finish(frame);
+  }
+
+  auto end = std::chrono::high_resolution_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  return n / seconds;
+}
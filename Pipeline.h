@@ -0,0 +1,47 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <memory>
+#include "Strategy.h"
+
+/**
+ * Labels a sequence of frames with a gpu strategy, overlapping the upload of
+ * a frame with the computation of the previous one and the download of the
+ * one before that.  Each stage has its own queue, and every frame in flight
+ * its own strategy, so their device buffers don't collide.
+ */
+class Pipeline {
+private:
+  static const size_t slots = 3;
+
+  cl::Context *context;
+  cl::Program *program;
+  cl::CommandQueue upload_queue;
+  cl::CommandQueue compute_queue;
+  cl::CommandQueue download_queue;
+  std::unique_ptr<GPUBase> strats[slots];
+
+  // Per slot, the downloaded labels and when they are ready.
+  LabelData results[slots];
+  cl::Event uploaded[slots];
+  cl::Event downloaded[slots];
+
+public:
+  /**
+   * make creates one of the strategies to use, and is called once per slot.
+   */
+  Pipeline(const std::function<GPUBase *()> &make, cl::Context *context,
+           cl::Device *device, cl::Program *program);
+
+  std::string name() { return strats[0]->name(); }
+
+  /**
+   * Labels every frame in order, handing each result to done as it arrives.
+   * Returns the sustained rate in frames per second.
+   */
+  double run(const std::vector<const LabelData *> &frames,
+             const std::function<void(size_t, const LabelData &)> &done =
+                 nullptr);
+};
+
+#endif /* end of include guard: PIPELINE_H */
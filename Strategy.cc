@@ -1,4 +1,15 @@
 #include "Strategy.h"
+#include "Equivalence.h"
+#include "Tuning.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 int round_to_nearest(int x, int mod) {
   if (x % mod) {
@@ -14,19 +25,107 @@ void CPUBase::copy_to(const LabelData *in, cl::Context *, cl::Program *,
 
 LabelData CPUBase::copy_from() { return std::move(l); }
 
-void CPUOnePass::execute() {
+size_t CPUBase::relabel() {
+  const size_t n = l.width * l.height;
+  LABELTYPE *d = l.data;
+  if (n == 0) {
+    return 0;
+  }
+
+  size_t threads = std::thread::hardware_concurrency();
+  threads = std::min(std::max(threads, (size_t)1), n);
+  const size_t chunk = (n + threads - 1) / threads;
+  threads = (n + chunk - 1) / chunk;
+
+  // Runs f(chunk index, begin, end) on every chunk on its own thread.
+  auto parallel = [&](auto f) {
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < threads; ++t) {
+      pool.emplace_back(f, t, chunk * t, std::min(chunk * (t + 1), n));
+    }
+    for (auto &th : pool) {
+      th.join();
+    }
+  };
+
+  std::vector<LABELTYPE> maxes(threads, 0);
+  parallel([&](size_t t, size_t begin, size_t end) {
+    maxes[t] = *std::max_element(d + begin, d + end);
+  });
+  const size_t labels = *std::max_element(maxes.begin(), maxes.end()) + 1;
+
+  // Index of the first pixel of every label.
+  std::unique_ptr<std::atomic<size_t>[]> first(
+      new std::atomic<size_t>[labels]);
+  parallel([&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin * labels / n; i < end * labels / n; ++i) {
+      first[i].store(n, std::memory_order_relaxed);
+    }
+  });
+  parallel([&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      LABELTYPE label = d[i];
+      // Only the start of each run can be the first pixel.
+      if (!label || (i != begin && d[i - 1] == label)) {
+        continue;
+      }
+      size_t cur = first[label].load(std::memory_order_relaxed);
+      while (i < cur && !first[label].compare_exchange_weak(
+                            cur, i, std::memory_order_relaxed)) {
+      }
+    }
+  });
+
+  std::vector<size_t> offsets(threads + 1, 0);
+  parallel([&](size_t t, size_t begin, size_t end) {
+    size_t count = 0;
+    for (size_t i = begin; i < end; ++i) {
+      count += d[i] && first[d[i]].load(std::memory_order_relaxed) == i;
+    }
+    offsets[t + 1] = count;
+  });
+  for (size_t t = 0; t < threads; ++t) {
+    offsets[t + 1] += offsets[t];
+  }
+
+  std::vector<LABELTYPE> ids(labels, 0);
+  parallel([&](size_t t, size_t begin, size_t end) {
+    size_t next = offsets[t];
+    for (size_t i = begin; i < end; ++i) {
+      if (d[i] && first[d[i]].load(std::memory_order_relaxed) == i) {
+        ids[d[i]] = ++next;
+      }
+    }
+  });
+  parallel([&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      d[i] = ids[d[i]];
+    }
+  });
+
+  return offsets[threads];
+}
+
+std::vector<ComponentStats> CPUBase::statistics() {
+  size_t count = relabel();
+  return component_stats(&l, count);
+}
+
+template <int CONN>
+void CPUOnePass<CONN>::execute() {
   size_t nr = 2;
   for (size_t y = 0; y < l.height; ++y) {
     for (size_t x = 0; x < l.width; ++x) {
       if (l.data[l.width * y + x] == 1) {
-        mark_explore(x, y, &l, 1, nr);
+        mark_explore<CONN>(x, y, &l, 1, nr);
         ++nr;
       }
     }
   }
 }
 
-int CPUUnionFind::find_set(int loc) {
+template <int CONN>
+int CPUUnionFind<CONN>::find_set(int loc) {
   // All loc of found elements should be in range.  Also assuming there are no
   // cycles in the links.  We stop when we encounter a root pixel, such that
   // it's label is its own index+2.
@@ -36,7 +135,19 @@ int CPUUnionFind::find_set(int loc) {
   return loc;
 }
 
-void CPUUnionFind::execute() {
+template <int CONN>
+void CPUUnionFind<CONN>::unite(int a, int b) {
+  int A = find_set(a);
+  int B = find_set(b);
+  if (A < B) {
+    l.data[B] = A + 2;
+  } else if (B < A) {
+    l.data[A] = B + 2;
+  }
+}
+
+template <int CONN>
+void CPUUnionFind<CONN>::execute() {
   auto w = l.width;
   auto h = l.height;
   auto d = l.data;
@@ -67,6 +178,17 @@ void CPUUnionFind::execute() {
         } else {
           d[locCur] = w * y + x + 2;
         }
+
+        if (CONN == 8 && !(y > 0 && d[locN])) {
+          // The upper diagonals are already joined through N when it is set,
+          // and NW through W.
+          if (x + 1 < w && y > 0 && d[locN + 1]) {
+            unite(locCur, locN + 1);
+          }
+          if (x > 0 && y > 0 && d[locN - 1] && !d[locW]) {
+            unite(locCur, locN - 1);
+          }
+        }
       }
     }
   }
@@ -80,17 +202,326 @@ void CPUUnionFind::execute() {
   }
 }
 
-void CPULinearTwoScan::copy_to(const LabelData *in, cl::Context *,
-                               cl::Program *, cl::CommandQueue *) {
+template <int CONN>
+int CPUParallelUnionFind<CONN>::find_set(int loc) {
+  while (loc != l.data[loc] - 2) {
+    loc = l.data[loc] - 2;
+  }
+  return loc;
+}
+
+template <int CONN>
+int CPUParallelUnionFind<CONN>::find_set(int loc, int begin, int end) {
+  while (loc != l.data[loc] - 2) {
+    loc = l.data[loc] - 2;
+    if (loc < begin || loc >= end) {
+      break;
+    }
+  }
+  return loc;
+}
+
+template <int CONN>
+int CPUParallelUnionFind<CONN>::unite(int a, int b) {
+  int A = find_set(a);
+  int B = find_set(b);
+  if (A < B) {
+    l.data[B] = A + 2;
+    return B;
+  } else if (B < A) {
+    l.data[A] = B + 2;
+    return A;
+  }
+  return -1;
+}
+
+template <int CONN>
+void CPUParallelUnionFind<CONN>::label_band(size_t ybegin, size_t yend) {
+  auto w = l.width;
+  auto d = l.data;
+
+  for (size_t y = ybegin; y < yend; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      int locCur = w * y + x;
+      int locN = w * (y - 1) + (x);
+      int locW = w * (y) + (x - 1);
+
+      // The row above the band belongs to another thread, so it is ignored
+      // here and handled when merging the seams.
+      bool okN = y > ybegin && d[locN];
+      bool okW = x > 0 && d[locW];
+
+      if (d[locCur] == 1) {
+        if (okN && okW) {
+          int N = find_set(locN);
+          int W = find_set(locW);
+
+          if (N + 2 < W) {
+            d[locCur] = N + 2;
+            d[W] = N + 2;
+          } else {
+            d[locCur] = W + 2;
+            d[N] = W + 2;
+          }
+        } else if (okW) {
+          d[locCur] = d[locW];
+        } else if (okN) {
+          d[locCur] = d[locN];
+        } else {
+          d[locCur] = locCur + 2;
+        }
+
+        if (CONN == 8 && !okN && y > ybegin) {
+          if (x + 1 < w && d[locN + 1]) {
+            unite(locCur, locN + 1);
+          }
+          if (x > 0 && d[locN - 1] && !okW) {
+            unite(locCur, locN - 1);
+          }
+        }
+      }
+    }
+  }
+}
+
+template <int CONN>
+void CPUParallelUnionFind<CONN>::flatten_band(size_t ybegin, size_t yend) {
+  auto w = l.width;
+  auto d = l.data;
+  int begin = w * ybegin;
+  int end = w * yend;
+
+  for (int loc = begin; loc < end; ++loc) {
+    if (d[loc]) {
+      d[loc] = find_set(loc, begin, end) + 2;
+    }
+  }
+}
+
+template <int CONN>
+void CPUParallelUnionFind<CONN>::execute() {
+  auto w = l.width;
+  auto h = l.height;
+  auto d = l.data;
+
+  size_t n = threads ? threads : std::thread::hardware_concurrency();
+  n = std::min(std::max(n, (size_t)1), h);
+  if (n == 0) {
+    return;
+  }
+  size_t band = (h + n - 1) / n;
+
+  std::vector<std::thread> pool;
+  for (size_t y = 0; y < h; y += band) {
+    pool.emplace_back(&CPUParallelUnionFind::label_band, this, y,
+                      std::min(y + band, h));
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+  pool.clear();
+
+  // Merge along the seams, always hooking the larger root onto the smaller
+  // one.  Every root that got hooked is then pointed directly at its final
+  // root, such that paths leave a band at most once and only at the end.
+  std::vector<int> hooked;
+  auto seam = [&](int a, int b) {
+    int root = unite(a, b);
+    if (root >= 0) {
+      hooked.push_back(root);
+    }
+  };
+  for (size_t y = band; y < h; y += band) {
+    for (size_t x = 0; x < w; ++x) {
+      int locCur = w * y + x;
+      int locN = w * (y - 1) + (x);
+      if (!d[locCur]) {
+        continue;
+      }
+      if (d[locN]) {
+        seam(locCur, locN);
+      } else if (CONN == 8) {
+        if (x + 1 < w && d[locN + 1]) {
+          seam(locCur, locN + 1);
+        }
+        if (x > 0 && d[locN - 1]) {
+          seam(locCur, locN - 1);
+        }
+      }
+    }
+  }
+  for (int root : hooked) {
+    d[root] = find_set(root) + 2;
+  }
+
+  for (size_t y = 0; y < h; y += band) {
+    pool.emplace_back(&CPUParallelUnionFind::flatten_band, this, y,
+                      std::min(y + band, h));
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+}
+
+template <int CONN>
+void CPURunUnionFind<CONN>::copy_to(const LabelData *in, cl::Context *,
+                                    cl::Program *, cl::CommandQueue *) {
+  l = *in;
+  // runs grows to what the image needs, and keeps that between executions.
+  row_start.resize(l.height + 1);
+}
+
+template <int CONN>
+int CPURunUnionFind<CONN>::find_set(int run) {
+  int root = run;
+  while (runs[root].parent != root) {
+    root = runs[root].parent;
+  }
+  // Path compression, everything on the way points at the root afterwards.
+  while (runs[run].parent != root) {
+    int next = runs[run].parent;
+    runs[run].parent = root;
+    run = next;
+  }
+  return root;
+}
+
+template <int CONN>
+void CPURunUnionFind<CONN>::extract_runs(const LABELTYPE *row, int w) {
+  int x = 0;
+  while (x < w) {
+#ifdef __SSE2__
+    // Skip whole blocks of background while looking for the start of a run.
+    const __m128i zero = _mm_setzero_si128();
+    while (x + 4 <= w) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero)) != 0xFFFF) {
+        break;
+      }
+      x += 4;
+    }
+#endif
+    while (x < w && !row[x]) {
+      ++x;
+    }
+    if (x == w) {
+      break;
+    }
+
+    int start = x;
+#ifdef __SSE2__
+    // Likewise skip whole blocks of foreground while looking for its end.
+    while (x + 4 <= w) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero)) != 0) {
+        break;
+      }
+      x += 4;
+    }
+#endif
+    while (x < w && row[x]) {
+      ++x;
+    }
+
+    int id = runs.size();
+    runs.push_back({start, x, id});
+  }
+}
+
+template <int CONN>
+void CPURunUnionFind<CONN>::execute() {
+  auto w = l.width;
+  auto h = l.height;
+  auto d = l.data;
+
+  runs.clear();
+  for (size_t y = 0; y < h; ++y) {
+    row_start[y] = runs.size();
+    extract_runs(d + w * y, w);
+  }
+  row_start[h] = runs.size();
+
+  // Unite overlapping runs of neighbouring rows, both lists are sorted on x
+  // so they can be walked in step.  With 8-connectivity runs that only touch
+  // diagonally count as overlapping too.
+  const int touch = CONN == 8 ? 1 : 0;
+  for (size_t y = 1; y < h; ++y) {
+    size_t up = row_start[y - 1];
+    size_t upend = row_start[y];
+    size_t cur = row_start[y];
+    size_t curend = row_start[y + 1];
+
+    while (up < upend && cur < curend) {
+      const Run &u = runs[up];
+      const Run &c = runs[cur];
+      if (u.start < c.end + touch && c.start < u.end + touch) {
+        int U = find_set(up);
+        int C = find_set(cur);
+        if (U < C) {
+          runs[C].parent = U;
+        } else if (C < U) {
+          runs[U].parent = C;
+        }
+      }
+      // Advance whichever run ends first, it can't overlap anything further.
+      if (u.end < c.end) {
+        ++up;
+      } else {
+        ++cur;
+      }
+    }
+  }
+
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t r = row_start[y]; r < row_start[y + 1]; ++r) {
+      LABELTYPE label = find_set(r) + 2;
+      std::fill(d + w * y + runs[r].start, d + w * y + runs[r].end, label);
+    }
+  }
+}
+
+template <int CONN>
+void CPULinearTwoScan<CONN>::copy_to(const LabelData *in, cl::Context *,
+                                     cl::Program *, cl::CommandQueue *) {
   l = *in;
   auto w = l.width;
   auto h = l.height;
-  rl_table.resize(w * h);
-  n_label.resize(w * h);
-  t_label.resize(w * h);
+  // Labels start at 2, and tiny images may have more labels than pixels/2.
+  rl_table.resize(w * h + 2);
+  n_label.resize(w * h + 2);
+  t_label.resize(w * h + 2);
+}
+
+template <int CONN>
+void CPULinearTwoScan<CONN>::new_label(unsigned int m) {
+  rl_table[m] = m;
+  n_label[m] = -1;
+  t_label[m] = m;
+}
+
+template <int CONN>
+void CPULinearTwoScan<CONN>::merge(unsigned int a, unsigned int b) {
+  unsigned int u = rl_table[a];
+  unsigned int v = rl_table[b];
+  // this part resolves potential label equivalence
+  if (u > 1 && v > 1 && u != v) {
+    if (v < u) {
+      std::swap(u, v);
+    }
+
+    // this part is coded exactly as shown with pseudo code in the paper
+    int i = v;
+    while (i != -1) {
+      rl_table[i] = u;
+      i = n_label[i];
+    }
+    n_label[t_label[u]] = v;
+    t_label[u] = t_label[v];
+  }
 }
 
-void CPULinearTwoScan::execute() {
+template <int CONN>
+void CPULinearTwoScan<CONN>::execute() {
   auto w = l.width;
   auto h = l.height;
   auto d = l.data;
@@ -116,35 +547,205 @@ void CPULinearTwoScan::execute() {
           uP = d[(y - 1) * w + x];
         }
 
+        // upper diagonal pixels, only needed without an upper pixel as they
+        // would otherwise already be joined through it
+        int ulP = 0;
+        int urP = 0;
+        if (CONN == 8 && y && !uP) {
+          if (x) {
+            ulP = d[(y - 1) * w + (x - 1)];
+          }
+          if (x + 1 < w) {
+            urP = d[(y - 1) * w + (x + 1)];
+          }
+        }
+
         // Need new label
-        if (!lP && !uP) {
+        if (!lP && !uP && !ulP && !urP) {
           d[bXY] = m;
-          rl_table[m] = m;
-          n_label[m] = -1;
-          t_label[m] = m;
+          new_label(m);
           ++m;
         } else if (lP) {
           d[bXY] = lP;
-        } else {
+        } else if (uP) {
           d[bXY] = uP;
+        } else if (ulP) {
+          d[bXY] = ulP;
+        } else {
+          d[bXY] = urP;
         }
 
-        unsigned int u = rl_table[lP];
-        unsigned int v = rl_table[uP];
-        // this part resolves potential label equivalence
-        if (u > 1 && v > 1 && u != v) {
-          if (v < u) {
-              std::swap(u, v);
-          }
+        merge(lP, uP);
+        if (CONN == 8) {
+          merge(d[bXY], ulP);
+          merge(d[bXY], urP);
+        }
+      }
+    }
+  }
+
+  // 2nd scan, only assigns correct values
+  for (size_t y = 0; y < h; ++y) {
+    for (size_t x = 0; x < w; ++x) {
+      if (d[y * w + x] != 0) {
+        d[y * w + x] = rl_table[d[y * w + x]];
+      }
+    }
+  }
+}
+
+namespace {
+// Pixels of a 2x2 block, laid out as  a b
+//                                     c d
+enum BlockPixel { PX_A = 1, PX_B = 2, PX_C = 4, PX_D = 8 };
+
+// Already labeled pixels a part of a block may be connected to, those above a
+// and b and those to the left of a and c.  With 8-connectivity also the ones
+// diagonally above a and b.
+enum BlockRead {
+  UP_A = 1,
+  UP_B = 2,
+  LEFT_A = 4,
+  LEFT_C = 8,
+  UP_LEFT = 16,
+  UP_RIGHT = 32
+};
+
+struct BlockPart {
+  unsigned char pixels;
+  unsigned char reads;
+};
+
+struct BlockCase {
+  int parts;
+  BlockPart part[2];
+};
+
+std::array<BlockCase, 16> make_block_table(int connectivity) {
+  std::array<BlockCase, 16> table{};
+  for (unsigned int mask = 0; mask < 16; ++mask) {
+    BlockCase &c = table[mask];
+    if (connectivity == 4 &&
+        (mask == (PX_A | PX_D) || mask == (PX_B | PX_C))) {
+      // Diagonal pairs are the only patterns not 4-connected within the block
+      c.parts = 2;
+      c.part[0].pixels = mask & (PX_A | PX_B);
+      c.part[1].pixels = mask & (PX_C | PX_D);
+    } else if (mask) {
+      c.parts = 1;
+      c.part[0].pixels = mask;
+    }
 
-          // this part is coded exactly as shown with pseudo code in the paper
-          int i = v;
-          while (i != -1) {
-            rl_table[i] = u;
-            i = n_label[i];
+    for (int p = 0; p < c.parts; ++p) {
+      unsigned char px = c.part[p].pixels;
+      if (connectivity == 4) {
+        c.part[p].reads = ((px & PX_A) ? UP_A | LEFT_A : 0) |
+                          ((px & PX_B) ? UP_B : 0) |
+                          ((px & PX_C) ? LEFT_C : 0);
+      } else {
+        c.part[p].reads =
+            ((px & PX_A) ? UP_LEFT | UP_A | UP_B | LEFT_A | LEFT_C : 0) |
+            ((px & PX_B) ? UP_A | UP_B | UP_RIGHT : 0) |
+            ((px & PX_C) ? LEFT_A | LEFT_C : 0);
+      }
+    }
+  }
+  return table;
+}
+
+const std::array<BlockCase, 16> block_table4 = make_block_table(4);
+const std::array<BlockCase, 16> block_table8 = make_block_table(8);
+}
+
+template <int CONN>
+void CPUBlockTwoScan<CONN>::execute() {
+  auto w = this->l.width;
+  auto h = this->l.height;
+  auto d = this->l.data;
+  const auto &table = CONN == 8 ? block_table8 : block_table4;
+
+  unsigned int m = 2;
+
+  for (size_t y = 0; y < h; y += 2) {
+    bool below = y + 1 < h;
+    for (size_t x = 0; x < w; x += 2) {
+      bool right = x + 1 < w;
+      size_t a = y * w + x;
+      size_t b = a + 1;
+      size_t c = a + w;
+      size_t e = c + 1;
+
+      unsigned int mask = (d[a] ? PX_A : 0) | (right && d[b] ? PX_B : 0) |
+                          (below && d[c] ? PX_C : 0) |
+                          (right && below && d[e] ? PX_D : 0);
+      const BlockCase &bc = table[mask];
+
+      for (int p = 0; p < bc.parts; ++p) {
+        unsigned int reads = bc.part[p].reads;
+        if (!y) { // OOR check, once per block
+          reads &= ~(UP_A | UP_B | UP_LEFT | UP_RIGHT);
+        }
+        if (!x) {
+          reads &= ~(LEFT_A | LEFT_C | UP_LEFT);
+        }
+        if (!below) {
+          reads &= ~LEFT_C;
+        }
+        if (!right) {
+          reads &= ~(UP_B | UP_RIGHT);
+        } else if (x + 2 >= w) {
+          reads &= ~UP_RIGHT;
+        }
+
+        // Take the first labeled neighbour, and join any others to it
+        unsigned int label = 0;
+        auto look = [&](unsigned int n) {
+          if (!n) {
+            return;
           }
-          n_label[t_label[u]] = v;
-          t_label[u] = t_label[v];
+          if (label) {
+            this->merge(label, n);
+          } else {
+            label = n;
+          }
+        };
+        if (reads & UP_A) {
+          look(d[a - w]);
+        }
+        if (reads & UP_B) {
+          look(d[b - w]);
+        }
+        if (reads & LEFT_A) {
+          look(d[a - 1]);
+        }
+        if (reads & LEFT_C) {
+          look(d[c - 1]);
+        }
+        if (CONN == 8 && (reads & UP_LEFT)) {
+          look(d[a - w - 1]);
+        }
+        if (CONN == 8 && (reads & UP_RIGHT)) {
+          look(d[b - w + 1]);
+        }
+
+        if (!label) {
+          label = m;
+          this->new_label(m);
+          ++m;
+        }
+
+        unsigned char px = bc.part[p].pixels;
+        if (px & PX_A) {
+          d[a] = label;
+        }
+        if (px & PX_B) {
+          d[b] = label;
+        }
+        if (px & PX_C) {
+          d[c] = label;
+        }
+        if (px & PX_D) {
+          d[e] = label;
         }
       }
     }
@@ -154,21 +755,70 @@ void CPULinearTwoScan::execute() {
   for (size_t y = 0; y < h; ++y) {
     for (size_t x = 0; x < w; ++x) {
       if (d[y * w + x] != 0) {
-        d[y * w + x] = rl_table[d[y * w + x]];
+        d[y * w + x] = this->rl_table[d[y * w + x]];
       }
     }
   }
 }
 
-void CPUFrontBack::copy_to(const LabelData *in, cl::Context *, cl::Program *,
-                           cl::CommandQueue *) {
+template <int CONN>
+void CPUFrontBack<CONN>::copy_to(const LabelData *in, cl::Context *,
+                                 cl::Program *, cl::CommandQueue *) {
   l = *in;
   auto w = l.width;
   auto h = l.height;
-  labelConnT.resize(w * h);
+  labelConnT.resize(w * h + 2);
+}
+
+template <int CONN>
+int CPUFrontBack<CONN>::neighbours(size_t x, size_t y, bool forward,
+                                   int *n) {
+  auto w = l.width;
+  auto h = l.height;
+  auto d = l.data;
+  int count = 0;
+
+  auto add = [&](int label) {
+    if (label) {
+      n[count++] = label;
+    }
+  };
+
+  if (forward) {
+    // left and upper pixel
+    if (x) { // OOR check
+      add(d[y * w + (x - 1)]);
+    }
+    if (y) {
+      add(d[(y - 1) * w + x]);
+      if (CONN == 8 && x) {
+        add(d[(y - 1) * w + (x - 1)]);
+      }
+      if (CONN == 8 && x + 1 < w) {
+        add(d[(y - 1) * w + (x + 1)]);
+      }
+    }
+  } else {
+    // right and south pixel
+    if (x + 1 < w) { // OOR check
+      add(d[y * w + (x + 1)]);
+    }
+    if (y + 1 < h) {
+      add(d[(y + 1) * w + x]);
+      if (CONN == 8 && x + 1 < w) {
+        add(d[(y + 1) * w + (x + 1)]);
+      }
+      if (CONN == 8 && x) {
+        add(d[(y + 1) * w + (x - 1)]);
+      }
+    }
+  }
+
+  return count;
 }
 
-void CPUFrontBack::execute() {
+template <int CONN>
+void CPUFrontBack<CONN>::execute() {
   auto w = l.width;
   auto h = l.height;
   auto d = l.data;
@@ -179,667 +829,1297 @@ void CPUFrontBack::execute() {
 
   int m = 2;
   bool change = true;
+  int n[4];
 
   for (size_t y = 0; y < h; ++y) {
     for (size_t x = 0; x < w; ++x) {
       // position of b(x, y);
       int bXY = y * w + x;
       if (d[bXY]) {
-        // left pixel
-        int lP = 0;
-        if (x) { // OOR check
-          lP = d[y * w + (x - 1)];
-        }
-
-        // upper pixel
-        int uP = 0;
-        if (y) { // OOR check
-          uP = d[(y - 1) * w + x];
-        }
+        int count = neighbours(x, y, true, n);
 
-        if (!lP && !uP) {
+        if (!count) {
           d[bXY] = m;
           labelConnT[m] = m;
           ++m;
         } else {
-          int min; // = d[bXY];
-          if (lP && !uP) {
-            min = labelConnT[lP];
-          } else if (!lP && uP) {
-            min = labelConnT[uP];
-          } else {
-            min = (labelConnT[lP] < labelConnT[uP]) ? labelConnT[lP]
-                                                    : labelConnT[uP];
+          int min = labelConnT[n[0]];
+          for (int i = 1; i < count; ++i) {
+            min = std::min(min, labelConnT[n[i]]);
           }
           d[bXY] = min;
-          if (uP) {
-            labelConnT[uP] = min;
-          }
-          if (lP) {
-            labelConnT[lP] = min;
+          for (int i = 0; i < count; ++i) {
+            labelConnT[n[i]] = min;
           }
         }
       }
     }
   }
 
+  // One scan over the pixels in either direction, pulling the smallest
+  // connected label in.
+  auto rescan = [&](size_t x, size_t y, bool forward) {
+    int bXY = y * w + x;
+    if (!d[bXY]) {
+      return;
+    }
+    int count = neighbours(x, y, forward, n);
+
+    int min = labelConnT[d[bXY]];
+    for (int i = 0; i < count; ++i) {
+      min = std::min(min, labelConnT[n[i]]);
+    }
+    d[bXY] = min;
+
+    for (int i = 0; i < count; ++i) {
+      if (labelConnT[n[i]] != min) {
+        labelConnT[n[i]] = min;
+        change = true;
+      }
+    }
+    if (labelConnT[d[bXY]] != min) {
+      labelConnT[d[bXY]] = min;
+      change = true;
+    }
+  };
+
   while (change) {
     change = false;
 
     // backwards scan
     for (int y = h - 1; y >= 0; --y) {
       for (int x = w - 1; x >= 0; --x) {
-        int bXY = y * w + x;
-        if (d[bXY]) {
-          // right pixel
-          int rP = 0;
-          if (x != (int)w - 1) { // OOR check
-            rP = d[y * w + (x + 1)];
-          }
-
-          // south pixel
-          int sP = 0;
-          if (y != (int)h - 1) { // OOR check
-            sP = d[(y + 1) * w + x];
-          }
+        rescan(x, y, false);
+      }
+    }
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) {
+        rescan(x, y, true);
+      }
+    }
+  }
+}
 
-          int min = -1;
-          int tMin = labelConnT[d[bXY]];
+template class CPUOnePass<4>;
+template class CPUOnePass<8>;
+template class CPUUnionFind<4>;
+template class CPUUnionFind<8>;
+template class CPUParallelUnionFind<4>;
+template class CPUParallelUnionFind<8>;
+template class CPURunUnionFind<4>;
+template class CPURunUnionFind<8>;
+template class CPULinearTwoScan<4>;
+template class CPULinearTwoScan<8>;
+template class CPUBlockTwoScan<4>;
+template class CPUBlockTwoScan<8>;
+template class CPUFrontBack<4>;
+template class CPUFrontBack<8>;
+
+void GPUBase::prepare(const LabelData *l, cl::Context *c, cl::Program *p,
+                      cl::CommandQueue *q, bool allow_map) {
+  cl_int err;
 
-          if (rP && sP) {
-            min = (labelConnT[rP] < labelConnT[sP]) ? labelConnT[rP]
-                                                    : labelConnT[sP];
-          } else if (rP && !sP) {
-            min = labelConnT[rP];
-          } else if (!rP && sP) {
-            min = labelConnT[sP];
-          }
-
-          if (tMin < min || min == -1) {
-            min = tMin;
-          }
-          d[bXY] = min;
+  if (variants) {
+    p = variants->get(l->width, l->height);
+  }
+  if (context != c) {
+    delete buf;
+    buf = nullptr;
+    scratches.clear();
+    chans.clear();
+  }
+  if (program != p) {
+    kernels.clear();
+  }
+  if (queue != q) {
+    cl::Device device = q->getInfo<CL_QUEUE_DEVICE>();
+    unified = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+    profiling =
+        q->getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE;
+  }
+  tracked.clear();
+  iterations = 0;
+  if (width != l->width || height != l->height) {
+    ++generation;
+    expected = 0;
+  }
+  context = c;
+  queue = q;
+  program = p;
+  width = l->width;
+  height = l->height;
 
-          if (rP && labelConnT[rP] != min) {
-            labelConnT[rP] = min;
-            change = true;
-          }
-          if (sP && labelConnT[sP] != min) {
-            labelConnT[sP] = min;
-            change = true;
-          }
-          if (labelConnT[d[bXY]] != min) {
-            labelConnT[d[bXY]] = min;
-            change = true;
-          }
-        }
-      }
+  auto size = width * height * sizeof(LABELTYPE);
+  if (allow_map && (transfer == Transfer::Map ||
+                    (transfer == Transfer::Auto && unified))) {
+    // The buffer works directly on memory of our own, which copy_from hands
+    // out with the labels in it, so each run gets new memory.
+    if (!buf || buf_size != size || !host.data) {
+      delete buf;
+      host = LabelData(width, height);
+      buf = new cl::Buffer(*c, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size,
+                           host.data, &err);
+      CHECKERR;
+      buf_size = size;
+      ++generation;
     }
-    for (size_t y = 0; y < h; ++y) {
-      for (size_t x = 0; x < w; ++x) {
-        int bXY = y * w + x;
-        if (d[bXY]) {
-          // left pixel
-          int lP = 0;
-          if (x) { // OOR check
-            lP = d[y * w + (x - 1)];
-          }
+  } else {
+    if (!buf || buf_size != size || host.data) {
+      delete buf;
+      buf = new cl::Buffer(*c, CL_MEM_READ_WRITE, size, nullptr, &err);
+      CHECKERR;
+      buf_size = size;
+      ++generation;
+    }
+    host = LabelData();
+  }
 
-          // upper pixel
-          int uP = 0;
-          if (y) { // OOR check
-            uP = d[(y - 1) * w + x];
-          }
+  // Only a byte per pixel is sent, execute labels buf from it.
+  const size_t n = width * height;
+  mask_host.resize(n);
+  std::transform(l->data, l->data + n, mask_host.begin(),
+                 [](LABELTYPE v) { return v != 0; });
+  from_mask = true;
+}
 
-          int min = -1;
-          int tMin = labelConnT[d[bXY]];
+void GPUBase::copy_to(const LabelData *l, cl::Context *c, cl::Program *p,
+                      cl::CommandQueue *q) {
+  prepare(l, c, p, q, true);
 
-          if (lP && uP) {
-            min = (labelConnT[lP] < labelConnT[uP]) ? labelConnT[lP]
-                                                    : labelConnT[uP];
-          } else if (lP && !uP) {
-            min = labelConnT[lP];
-          } else if (!lP && uP) {
-            min = labelConnT[uP];
-          }
+  const size_t n = width * height;
+  cl_int err = queue->enqueueWriteBuffer(scratch("mask", n), CL_TRUE, 0, n,
+                                         mask_host.data(), nullptr,
+                                         track("upload"));
+  CHECKERR;
+}
 
-          if (tMin < min || min == -1) {
-            min = tMin;
-          }
-          d[bXY] = min;
+void GPUBase::upload(const LabelData *l, cl::Context *c, cl::Program *p,
+                     cl::CommandQueue *q, cl::CommandQueue *transfer_queue,
+                     cl::Event *uploaded) {
+  prepare(l, c, p, q, false);
 
-          if (lP && labelConnT[lP] != min) {
-            labelConnT[lP] = min;
-            change = true;
-          }
-          if (uP && labelConnT[uP] != min) {
-            labelConnT[uP] = min;
-            change = true;
-          }
-          if (labelConnT[d[bXY]] != min) {
-            labelConnT[d[bXY]] = min;
-            change = true;
-          }
-        }
-      }
-    }
+  const size_t n = width * height;
+  cl_int err = transfer_queue->enqueueWriteBuffer(
+      scratch("mask", n), CL_FALSE, 0, n, mask_host.data(), nullptr, uploaded);
+  CHECKERR;
+  if (cl::Event *event = track("upload")) {
+    *event = *uploaded;
   }
+  transfer_queue->flush();
+  pending_upload.push_back(*uploaded);
 }
 
-void GPUBase::copy_to(const LabelData *l, cl::Context *c, cl::Program *p,
-                      cl::CommandQueue *q) {
-  context = c;
-  queue = q;
-  program = p;
-  width = l->width;
-  height = l->height;
-
+void GPUBase::download(LabelData *out, cl::CommandQueue *transfer_queue,
+                       cl::Event *downloaded) {
   cl_int err;
-  auto size = width * height * sizeof(LABELTYPE);
-  buf = new cl::Buffer(*c, CL_MEM_READ_WRITE, size, nullptr, &err);
+
+  cl::Event computed;
+  err = queue->enqueueMarker(&computed);
   CHECKERR;
+  queue->flush();
 
-  err = queue->enqueueWriteBuffer(*buf, CL_TRUE, 0, size, l->data);
+  if (out->width != width || out->height != height) {
+    *out = LabelData(width, height);
+  }
+  std::vector<cl::Event> wait{computed};
+  err = transfer_queue->enqueueReadBuffer(*buf, CL_FALSE, 0,
+                                          width * height * sizeof(LABELTYPE),
+                                          out->data, &wait, downloaded);
+  CHECKERR;
+  if (cl::Event *event = track("download")) {
+    *event = *downloaded;
+  }
+  transfer_queue->flush();
 }
 
 LabelData GPUBase::copy_from() {
-  LabelData ret(width, height);
-
+  cl_int err;
   auto size = width * height * sizeof(LABELTYPE);
-  queue->enqueueReadBuffer(*buf, CL_TRUE, 0, size, ret.data);
 
-  delete buf;
+  if (host.data) {
+    // Mapping makes the labels visible in host, which on unified memory is
+    // where they already are.  The memory is then handed out as it is, and
+    // the buffer using it has to go first.
+    void *mapped = queue->enqueueMapBuffer(*buf, CL_TRUE, CL_MAP_READ, 0, size,
+                                           nullptr, track("map"), &err);
+    CHECKERR;
+    cl::Event unmapped;
+    err = queue->enqueueUnmapMemObject(*buf, mapped, nullptr, &unmapped);
+    CHECKERR;
+    err = unmapped.wait();
+    CHECKERR;
+    delete buf;
+    buf = nullptr;
+    buf_size = 0;
+    return std::move(host);
+  }
+
+  LabelData ret(width, height);
+  queue->enqueueReadBuffer(*buf, CL_TRUE, 0, size, ret.data, nullptr,
+                           track("download"));
 
   return ret;
 }
 
-void GPUNeighbourPropagation::execute() {
-  cl_int err;
+GPUBase::~GPUBase() { delete buf; }
 
-  const int wgw = 32;
-  const int wgh = 4;
-  const int wsize = round_to_nearest(width, wgw);
-  const int hsize = round_to_nearest(height, wgh);
+void GPUBase::label_init(const cl::NDRange &global, const cl::NDRange &local,
+                         bool first_step) {
+  cl_int err;
 
-  cl::Kernel startlabel(*program, "label_with_id", &err);
-  CHECKERR;
-  cl::Kernel propagate(*program, "neighbour_propagate", &err);
-  CHECKERR;
+  // Only now, such that the queue isn't held up by an upload done early.
+  if (!pending_upload.empty()) {
+    err = queue->enqueueWaitForEvents(pending_upload);
+    CHECKERR;
+    pending_upload.clear();
+  }
 
-  err = startlabel.setArg(0, *buf);
-  CHECKERR;
-  err = startlabel.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = startlabel.setArg(2, (cl_int)height);
-  CHECKERR;
+  if (!from_mask) {
+    err = launch(kernel("label_with_id"), global, local);
+    CHECKERR;
+    return;
+  }
 
-  char changed = 1;
-  cl::Buffer chan(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
-  queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
+  cl::Buffer &mask = scratch("mask", width * height);
+  auto bind = [&](cl::Kernel &k) {
+    cl_int err = k.setArg(0, *buf);
+    CHECKERR;
+    err = k.setArg(1, (cl_int)width);
+    CHECKERR;
+    err = k.setArg(2, (cl_int)height);
+    CHECKERR;
+    err = k.setArg(3, mask);
+    CHECKERR;
+  };
+  const char *name =
+      first_step ? "neighbour_propagate_from_mask" : "label_from_mask";
+  err = launch(kernel(name, bind), global, local);
+  CHECKERR;
+  from_mask = false;
+}
 
-  err = propagate.setArg(0, *buf);
-  CHECKERR;
-  err = propagate.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = propagate.setArg(2, (cl_int)height);
-  CHECKERR;
-  err = propagate.setArg(3, chan);
-  CHECKERR;
+size_t GPUBase::label_init_sparse(int tw, int th, bool first_step) {
+  cl_int err;
 
-  err = queue->enqueueNDRangeKernel(startlabel, cl::NullRange,
-                                    cl::NDRange(wsize, hsize),
-                                    cl::NDRange(wgw, wgh));
-  CHECKERR;
+  const int wsize = round_to_nearest(width, tw);
+  const int hsize = round_to_nearest(height, th);
+  const int n = (wsize / tw) * (hsize / th);
+  label_init(cl::NDRange(wsize, hsize), cl::NDRange(tw, th), first_step);
+  if (n == 0) {
+    return 0;
+  }
 
-  while (true) {
-    // CPU-GPU sync, sadly
-    queue->enqueueReadBuffer(chan, CL_TRUE, 0, 1, &changed);
-    if (changed == false) {
-      break;
-    }
-    changed = false;
-    queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
+  const int wg = 256;
+  cl::Buffer &flags = scratch("tile flags", n * sizeof(cl_int));
+  cl::Buffer &tiles = scratch("tiles", n * sizeof(cl_int));
+  sparse_tiles = n;
+
+  cl::Kernel &occupancy = kernel("tile_occupancy", [&](cl::Kernel &k) {
+    err = k.setArg(0, *buf);
+    CHECKERR;
+    err = k.setArg(1, (cl_int)width);
+    CHECKERR;
+    err = k.setArg(2, (cl_int)height);
+    CHECKERR;
+    err = k.setArg(3, flags);
+    CHECKERR;
+  });
+  cl::Kernel &compact = kernel("tile_compact", [&](cl::Kernel &k) {
+    err = k.setArg(0, flags);
+    CHECKERR;
+    err = k.setArg(2, tiles);
+    CHECKERR;
+  });
+  // The tile size may change without anything being reallocated.
+  err = compact.setArg(1, (cl_int)n);
+  CHECKERR;
+
+  err = launch(occupancy, cl::NDRange(wsize, hsize), cl::NDRange(tw, th));
+  CHECKERR;
+  scan(&flags, n);
+  err = launch(compact, cl::NDRange(round_to_nearest(n, wg)), cl::NDRange(wg));
+  CHECKERR;
+
+  cl_int count = 0;
+  err = queue->enqueueReadBuffer(flags, CL_TRUE, (n - 1) * sizeof(cl_int),
+                                 sizeof(cl_int), &count, nullptr,
+                                 track("tile count"));
+  CHECKERR;
+  return count;
+}
 
-    queue->enqueueNDRangeKernel(propagate, cl::NullRange,
-                                cl::NDRange(wsize, hsize),
-                                cl::NDRange(wgw, wgh));
-  }
+cl::Kernel &GPUBase::sparse_kernel(const std::string &name) {
+  return kernel(name, [&](cl::Kernel &k) {
+    cl_int err = k.setArg(0, *buf);
+    CHECKERR;
+    err = k.setArg(1, (cl_int)width);
+    CHECKERR;
+    err = k.setArg(2, (cl_int)height);
+    CHECKERR;
+    err = k.setArg(4, scratch("tiles", sparse_tiles * sizeof(cl_int)));
+    CHECKERR;
+  });
 }
 
-void GPUNeighbourPropagation_Localer::execute() {
+void GPUBase::converge_frontier(cl::Kernel &k, int tw, int th, size_t count) {
   cl_int err;
 
-  const int wgw = 8;
-  const int wgh = 8;
-  const int wsize = round_to_nearest(width, wgw);
-  const int hsize = round_to_nearest(height, wgh);
+  const int across = round_to_nearest(width, tw) / tw;
+  const int down = round_to_nearest(height, th) / th;
+  const int n = across * down;
+  const int wg = 256;
+  const cl::NDRange all(round_to_nearest(n, wg));
 
-  cl::Kernel startlabel(*program, "label_with_id", &err);
-  CHECKERR;
-  cl::Kernel localer(*program, "solve_locally_plus", &err);
+  // The scanned occupancy and the tile list from label_init_sparse.
+  cl::Buffer &occupied = scratch("tile flags", n * sizeof(cl_int));
+  cl::Buffer &tiles = scratch("tiles", n * sizeof(cl_int));
+  cl::Buffer &dirty = scratch("tile dirty", n);
+  cl::Buffer &active = scratch("tile active", n * sizeof(cl_int));
+
+  // The tile count changes with the tile size alone, so these are always
+  // set.
+  auto unbound = [](cl::Kernel &) {};
+  cl::Kernel &clear = kernel("frontier_clear", unbound);
+  err = clear.setArg(0, dirty);
   CHECKERR;
-  cl::Kernel propagate(*program, "neighbour_propagate", &err);
+  err = clear.setArg(1, (cl_int)n);
   CHECKERR;
-
-  err = startlabel.setArg(0, *buf);
+  cl::Kernel &expand = kernel("frontier_expand", unbound);
+  err = expand.setArg(0, occupied);
   CHECKERR;
-  err = startlabel.setArg(1, (cl_int)width);
+  err = expand.setArg(1, dirty);
   CHECKERR;
-  err = startlabel.setArg(2, (cl_int)height);
+  err = expand.setArg(2, (cl_int)across);
   CHECKERR;
-
-  err = localer.setArg(0, *buf);
+  err = expand.setArg(3, (cl_int)down);
   CHECKERR;
-  err = localer.setArg(1, (cl_int)width);
+  err = expand.setArg(4, active);
   CHECKERR;
-  err = localer.setArg(2, (cl_int)height);
+  cl::Kernel &compact = kernel("frontier_compact", unbound);
+  err = compact.setArg(0, active);
   CHECKERR;
-
-  char changed = 1;
-  cl::Buffer chan(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
-  queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
-
-  err = propagate.setArg(0, *buf);
+  err = compact.setArg(1, (cl_int)n);
   CHECKERR;
-  err = propagate.setArg(1, (cl_int)width);
+  err = compact.setArg(2, tiles);
   CHECKERR;
-  err = propagate.setArg(2, (cl_int)height);
+  err = compact.setArg(3, dirty);
   CHECKERR;
-  err = propagate.setArg(3, chan);
+  err = k.setArg(3, dirty);
   CHECKERR;
 
-  err = queue->enqueueNDRangeKernel(startlabel, cl::NullRange,
-                                    cl::NDRange(wsize, hsize),
-                                    cl::NDRange(wgw, wgh));
+  err = launch(clear, all, cl::NDRange(wg));
   CHECKERR;
+  while (count) {
+    err = launch(k, cl::NDRange(count * tw, th), cl::NDRange(tw, th));
+    CHECKERR;
+    ++iterations;
 
-  while (true) {
-    // CPU-GPU sync, sadly
-    queue->enqueueReadBuffer(chan, CL_TRUE, 0, 1, &changed);
-    if (changed == false) {
-      break;
+    err = launch(expand, all, cl::NDRange(wg));
+    CHECKERR;
+    scan(&active, n);
+    err = launch(compact, all, cl::NDRange(wg));
+    CHECKERR;
+
+    cl_int next = 0;
+    err = queue->enqueueReadBuffer(active, CL_TRUE, (n - 1) * sizeof(cl_int),
+                                   sizeof(cl_int), &next, nullptr,
+                                   track("frontier count"));
+    CHECKERR;
+    count = next;
+  }
+}
+
+cl::Kernel &GPUBase::kernel(const std::string &name,
+                            const std::function<void(cl::Kernel &)> &bind) {
+  cl_int err;
+
+  auto it = kernels.find(name);
+  if (it == kernels.end()) {
+    CachedKernel cached;
+    cached.kernel = cl::Kernel(*program, name.c_str(), &err);
+    CHECKERR;
+    it = kernels.emplace(name, cached).first;
+  }
+
+  auto &cached = it->second;
+  if (cached.generation != generation) {
+    if (bind) {
+      bind(cached.kernel);
+    } else {
+      err = cached.kernel.setArg(0, *buf);
+      CHECKERR;
+      err = cached.kernel.setArg(1, (cl_int)width);
+      CHECKERR;
+      err = cached.kernel.setArg(2, (cl_int)height);
+      CHECKERR;
     }
-    changed = false;
-    queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
-    queue->enqueueNDRangeKernel(localer, cl::NullRange,
-                                cl::NDRange(wsize, hsize),
-                                cl::NDRange(wgw, wgh));
-    queue->enqueueNDRangeKernel(propagate, cl::NullRange,
-                                cl::NDRange(wsize, hsize),
-                                cl::NDRange(wgw, wgh));
+    cached.generation = generation;
   }
+  return cached.kernel;
 }
 
-void GPUPlusPropagation::execute() {
+cl::Buffer &GPUBase::scratch(const std::string &name, size_t size) {
   cl_int err;
 
-  const int wgw = 8;
-  const int wgh = 8;
-  const int wsize = round_to_nearest(width, wgw);
-  const int hsize = round_to_nearest(height, wgh);
+  auto &s = scratches[name];
+  if (s.size < size) {
+    s.buffer = cl::Buffer(*context, CL_MEM_READ_WRITE, size, nullptr, &err);
+    CHECKERR;
+    s.size = size;
+    ++generation;
+  }
+  return s.buffer;
+}
 
-  cl::Kernel startlabel(*program, "label_with_id", &err);
-  CHECKERR;
-  cl::Kernel propagate(*program, "plus_propagate", &err);
-  CHECKERR;
+cl_int GPUBase::launch(cl::Kernel &k, const cl::NDRange &global,
+                       const cl::NDRange &local) {
+  if (!profiling) {
+    return queue->enqueueNDRangeKernel(k, cl::NullRange, global, local);
+  }
 
-  err = startlabel.setArg(0, *buf);
-  CHECKERR;
-  err = startlabel.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = startlabel.setArg(2, (cl_int)height);
-  CHECKERR;
+  tracked.push_back({k.getInfo<CL_KERNEL_FUNCTION_NAME>(), true, cl::Event()});
+  return queue->enqueueNDRangeKernel(k, cl::NullRange, global, local, nullptr,
+                                     &tracked.back().event);
+}
+
+size_t GPUBase::max_work_group() {
+  cl::Device device = queue->getInfo<CL_QUEUE_DEVICE>();
+  return kernel(tuned_kernel())
+      .getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+}
+
+size_t GPUBase::preferred_multiple() {
+  cl::Device device = queue->getInfo<CL_QUEUE_DEVICE>();
+  return kernel(tuned_kernel())
+      .getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+}
+
+void GPUBase::tile_shape(const std::string &name, int *x, int *y) {
+  cl::Device device = queue->getInfo<CL_QUEUE_DEVICE>();
+  cl::size_t<3> size =
+      kernel(name).getWorkGroupInfo<CL_KERNEL_COMPILE_WORK_GROUP_SIZE>(device);
+  *x = size[0];
+  *y = size[1];
+}
+
+void GPUBase::force_work_group(int x, int y) {
+  forced_x = x;
+  forced_y = y;
+}
+
+bool GPUBase::legal_work_group(int x, int y) {
+  if (x < 1 || y < 1 || tuned_kernel().empty()) {
+    return false;
+  }
+  cl::Device device = queue->getInfo<CL_QUEUE_DEVICE>();
+  cl::Kernel &k = kernel(tuned_kernel());
+  cl::size_t<3> compiled =
+      k.getWorkGroupInfo<CL_KERNEL_COMPILE_WORK_GROUP_SIZE>(device);
+  if (compiled[0] && (compiled[0] != (size_t)x || compiled[1] != (size_t)y)) {
+    return false;
+  }
+  auto sizes = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+  return (size_t)x <= sizes[0] && (size_t)y <= sizes[1] &&
+         (size_t)(x * y) <= max_work_group();
+}
+
+void GPUBase::work_group(int *x, int *y) {
+  int tx, ty;
+  if (forced_x) {
+    tx = forced_x;
+    ty = forced_y;
+  } else if (!tuning || !tuning->get(name(), &tx, &ty) ||
+             !legal_work_group(tx, y ? ty : 1)) {
+    return;
+  }
+  *x = tx;
+  if (y) {
+    *y = ty;
+  }
+}
+
+cl::Event *GPUBase::track(const std::string &name) {
+  if (!profiling) {
+    return nullptr;
+  }
+  tracked.push_back({name, false, cl::Event()});
+  return &tracked.back().event;
+}
+
+GPUBase::Profile GPUBase::profile() {
+  Profile p;
+  p.iterations = iterations;
+  for (auto &t : tracked) {
+    t.event.wait();
+    auto queued = t.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+    auto start = t.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    auto end = t.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+    auto &entry = (t.kernel ? p.kernels : p.transfers)[t.name];
+    entry.count += 1;
+    entry.ms += (end - start) * 1e-6;
+    entry.latency_ms += (start - queued) * 1e-6;
+  }
+  return p;
+}
+
+void GPUBase::scan(cl::Buffer *data, size_t n, int level) {
+  cl_int err;
 
-  char changed = 1;
-  cl::Buffer chan(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
-  queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
+  // Must match SCAN_WG in kernel.cl.
+  const int wg = 256;
+  const int blocks = (n + wg - 1) / wg;
 
-  err = propagate.setArg(0, *buf);
+  // Every level of the recursion keeps its own sums.
+  cl::Buffer &sums =
+      scratch("scan" + std::to_string(level), blocks * sizeof(cl_int));
+
+  // The arguments differ per level, so they are always set.
+  auto unbound = [](cl::Kernel &) {};
+  cl::Kernel &block = kernel("scan_block", unbound);
+  err = block.setArg(0, *data);
   CHECKERR;
-  err = propagate.setArg(1, (cl_int)width);
+  err = block.setArg(1, (cl_int)n);
   CHECKERR;
-  err = propagate.setArg(2, (cl_int)height);
+  err = block.setArg(2, sums);
   CHECKERR;
-  err = propagate.setArg(3, chan);
+  err = launch(block, cl::NDRange(blocks * wg), cl::NDRange(wg));
   CHECKERR;
 
-  err = queue->enqueueNDRangeKernel(startlabel, cl::NullRange,
-                                    cl::NDRange(wsize, hsize),
-                                    cl::NDRange(wgw, wgh));
-  CHECKERR;
+  if (blocks > 1) {
+    scan(&sums, blocks, level + 1);
 
-  while (true) {
-    // CPU-GPU sync, sadly
-    queue->enqueueReadBuffer(chan, CL_TRUE, 0, 1, &changed);
-    if (changed == false) {
-      break;
-    }
-    changed = false;
-    queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
-    queue->enqueueNDRangeKernel(propagate, cl::NullRange,
-                                cl::NDRange(wsize, hsize),
-                                cl::NDRange(wgw, wgh));
+    cl::Kernel &add = kernel("scan_add", unbound);
+    err = add.setArg(0, *data);
+    CHECKERR;
+    err = add.setArg(1, (cl_int)n);
+    CHECKERR;
+    err = add.setArg(2, sums);
+    CHECKERR;
+    err = launch(add, cl::NDRange(blocks * wg), cl::NDRange(wg));
+    CHECKERR;
   }
 }
 
-void GPUUnionFind::execute() {
+size_t GPUBase::relabel() {
   cl_int err;
 
-  const int wgw = 16;
-  const int wgh = 8;
-  const int wsize = round_to_nearest(width, wgw);
-  const int hsize = round_to_nearest(height, wgh);
+  const int n = width * height;
+  if (n == 0) {
+    return 0;
+  }
+  const int wg = 256;
+  const int size = round_to_nearest(n, wg);
+
+  // Indexed by label, first the first pixel of it and then its new label.
+  cl::Buffer &first = scratch("first", (n + 2) * sizeof(cl_int));
+  cl::Buffer &flags = scratch("flags", n * sizeof(cl_int));
+
+  auto bind = [&](cl::Kernel &k) {
+    cl_int err = k.setArg(0, *buf);
+    CHECKERR;
+    err = k.setArg(1, (cl_int)n);
+    CHECKERR;
+    err = k.setArg(2, first);
+    CHECKERR;
+  };
+  auto bindflags = [&](cl::Kernel &k) {
+    bind(k);
+    cl_int err = k.setArg(3, flags);
+    CHECKERR;
+  };
+  cl::Kernel &fill = kernel("relabel_fill", [&](cl::Kernel &k) {
+    cl_int err = k.setArg(0, first);
+    CHECKERR;
+    err = k.setArg(1, (cl_int)(n + 2));
+    CHECKERR;
+    err = k.setArg(2, (cl_int)n);
+    CHECKERR;
+  });
+  cl::Kernel &findfirst = kernel("relabel_first", bind);
+  cl::Kernel &flag = kernel("relabel_flag", bindflags);
+  cl::Kernel &assign = kernel("relabel_assign", bindflags);
+  cl::Kernel &apply = kernel("relabel_apply", bind);
+
+  err = launch(fill, cl::NDRange(round_to_nearest(n + 2, wg)), cl::NDRange(wg));
+  CHECKERR;
+  err = launch(findfirst, cl::NDRange(size), cl::NDRange(wg));
+  CHECKERR;
+  err = launch(flag, cl::NDRange(size), cl::NDRange(wg));
+  CHECKERR;
+  scan(&flags, n);
+  err = launch(assign, cl::NDRange(size), cl::NDRange(wg));
+  CHECKERR;
+  err = launch(apply, cl::NDRange(size), cl::NDRange(wg));
+  CHECKERR;
+
+  cl_int count = 0;
+  err = queue->enqueueReadBuffer(flags, CL_TRUE, (n - 1) * sizeof(cl_int),
+                                 sizeof(cl_int), &count, nullptr,
+                                 track("component count"));
+  CHECKERR;
+  return count;
+}
 
-  cl::Kernel startlabel(*program, "label_with_id", &err);
-  CHECKERR;
-  cl::Kernel propagate(*program, "union_find", &err);
-  CHECKERR;
+std::vector<ComponentStats> GPUBase::statistics() {
+  cl_int err;
 
-  err = startlabel.setArg(0, *buf);
-  CHECKERR;
-  err = startlabel.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = startlabel.setArg(2, (cl_int)height);
+  const int count = relabel();
+  if (count == 0) {
+    return {};
+  }
+
+  // Must match STATS_FIELDS in kernel.cl.
+  const int fields = 9;
+  std::vector<cl_uint> host(count * fields);
+  cl::Buffer &stats = scratch("stats", host.size() * sizeof(cl_uint));
+
+  // The count changes between calls, so it is always set.
+  cl::Kernel &init = kernel("stats_init", [&](cl::Kernel &k) {
+    cl_int err = k.setArg(0, stats);
+    CHECKERR;
+  });
+  err = init.setArg(1, (cl_int)count);
+  CHECKERR;
+  cl::Kernel &accumulate = kernel("stats_accumulate", [&](cl::Kernel &k) {
+    cl_int err = k.setArg(0, *buf);
+    CHECKERR;
+    err = k.setArg(1, (cl_int)width);
+    CHECKERR;
+    err = k.setArg(2, (cl_int)height);
+    CHECKERR;
+    err = k.setArg(3, stats);
+    CHECKERR;
+  });
+
+  const int wg = 256;
+  err = launch(init, cl::NDRange(round_to_nearest(count, wg)), cl::NDRange(wg));
   CHECKERR;
 
-  char changed = 1;
-  cl::Buffer chan(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
-  queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
+  const int wgw = 32;
+  const int wgh = 4;
+  err = launch(
+      accumulate,
+      cl::NDRange(round_to_nearest(width, wgw), round_to_nearest(height, wgh)),
+      cl::NDRange(wgw, wgh));
+  CHECKERR;
+
+  err = queue->enqueueReadBuffer(stats, CL_TRUE, 0,
+                                 host.size() * sizeof(cl_uint), host.data(),
+                                 nullptr, track("statistics"));
+  CHECKERR;
+
+  std::vector<ComponentStats> ret(count);
+  for (int i = 0; i < count; ++i) {
+    const cl_uint *f = &host[i * fields];
+    auto &s = ret[i];
+    s.label = i + 1;
+    s.area = f[0];
+    s.xmin = f[1];
+    s.ymin = f[2];
+    s.xmax = f[3];
+    s.ymax = f[4];
+    s.cx = (double)(((uint64_t)f[6] << 32) | f[5]) / s.area;
+    s.cy = (double)(((uint64_t)f[8] << 32) | f[7]) / s.area;
+  }
 
-  err = propagate.setArg(0, *buf);
-  CHECKERR;
-  err = propagate.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = propagate.setArg(2, (cl_int)height);
-  CHECKERR;
-  err = propagate.setArg(3, chan);
-  CHECKERR;
+  return ret;
+}
 
-  err = queue->enqueueNDRangeKernel(startlabel, cl::NullRange,
-                                    cl::NDRange(wsize, hsize),
-                                    cl::NDRange(wgw, wgh));
-  CHECKERR;
+namespace {
+// Source of the non-blocking flag clears, so it has to outlive them.
+const char zero = 0;
+}
 
+void GPUBase::converge(std::initializer_list<cl::Kernel *> flagged,
+                       const std::function<void()> &iteration) {
+  cl_int err;
+
+  // Every batch gets its own flag, cleared before and read back after it
+  // without blocking.  A batch that changed nothing means that its first
+  // iteration already changed nothing, so we are done, having needed at most
+  // the iterations before it and that one.  That bound is kept in expected for
+  // the next run, which likely converges alike, as for repetitions or the
+  // frames of a sequence.  Its batches halve towards the bound, down to single
+  // iterations just before and at it, so a run needing as many stops right
+  // there, and one needing fewer stops within one of the halving batches, which
+  // tightens the bound.  Past expected, or without one, the batches double from
+  // 1 while they keep changing things.  At most ring batches are queued ahead
+  // of the one being waited for, so capping them bounds the overshoot of a run
+  // to ring * max_batch iterations, while a long run is still only checked
+  // every max_batch iterations.
+  const size_t ring = 2;
+  const int max_batch = 16;
+  while (chans.size() < ring) {
+    chans.emplace_back(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
+    CHECKERR;
+  }
+
+  if (convergence == Convergence::Blocking) {
+    char changed = 1;
+    for (auto *k : flagged) {
+      err = k->setArg(3, chans[0]);
+      CHECKERR;
+    }
+
+    while (changed) {
+      changed = false;
+      err = queue->enqueueWriteBuffer(chans[0], CL_FALSE, 0, 1, &changed,
+                                      nullptr, track("flag clear"));
+      CHECKERR;
+      iteration();
+      ++iterations;
+      // CPU-GPU sync, sadly
+      err = queue->enqueueReadBuffer(chans[0], CL_TRUE, 0, 1, &changed,
+                                     nullptr, track("flag read"));
+      CHECKERR;
+    }
+    return;
+  }
+
+  char changed[ring];
+  // The iteration each batch in flight starts at.
+  size_t starts[ring];
+  cl::Event done[ring];
+  int ramp = 1;
+  size_t ran = 0;
+  size_t issued = 0;
+  size_t checked = 0;
   while (true) {
-    // CPU-GPU sync, sadly
-    queue->enqueueReadBuffer(chan, CL_TRUE, 0, 1, &changed);
-    if (changed == false) {
+    while (issued - checked < ring) {
+      size_t slot = issued % ring;
+      int batch;
+      if (ran + 1 < expected) {
+        batch = std::min<size_t>((expected - ran) / 2, max_batch);
+      } else if (ran + 1 == expected) {
+        batch = 1;
+      } else {
+        batch = ramp;
+        ramp = std::min(ramp * 2, max_batch);
+      }
+
+      err = queue->enqueueWriteBuffer(chans[slot], CL_FALSE, 0, 1, &zero,
+                                      nullptr, track("flag clear"));
+      CHECKERR;
+      for (auto *k : flagged) {
+        err = k->setArg(3, chans[slot]);
+        CHECKERR;
+      }
+      for (int i = 0; i < batch; ++i) {
+        iteration();
+      }
+      starts[slot] = ran;
+      ran += batch;
+      iterations += batch;
+      err = queue->enqueueReadBuffer(chans[slot], CL_FALSE, 0, 1,
+                                     &changed[slot], nullptr, &done[slot]);
+      CHECKERR;
+      // The read has its own event to wait for, which is also the one to
+      // profile.
+      if (cl::Event *read = track("flag read")) {
+        *read = done[slot];
+      }
+      queue->flush();
+      ++issued;
+    }
+
+    size_t slot = checked % ring;
+    done[slot].wait();
+    ++checked;
+    if (!changed[slot]) {
+      expected = starts[slot] + 1;
       break;
     }
-    changed = false;
-    queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
-    queue->enqueueNDRangeKernel(propagate, cl::NullRange,
-                                cl::NDRange(wsize, hsize),
-                                cl::NDRange(wgw, wgh));
+  }
+
+  // The batches still in flight read into changed.
+  for (; checked < issued; ++checked) {
+    done[checked % ring].wait();
   }
 }
 
-void GPUUnionFind_Localer::execute() {
-  cl_int err;
+void GPUNeighbourPropagation::execute() {
+  int wgw = 32;
+  int wgh = 4;
+  work_group(&wgw, &wgh);
+  const int wsize = round_to_nearest(width, wgw);
+  const int hsize = round_to_nearest(height, wgh);
 
-  const int wgw = 8;
-  const int wgh = 8;
+  cl::Kernel &propagate = kernel("neighbour_propagate");
+
+  label_init(cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh));
+
+  converge({&propagate}, [&] {
+    cl_int err = launch(propagate, cl::NDRange(wsize, hsize),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
+}
+
+void GPUSparseNeighbourPropagation::execute() {
+  int wgw = 32;
+  int wgh = 4;
+  work_group(&wgw, &wgh);
+
+  const size_t count = label_init_sparse(wgw, wgh);
+  if (!count) {
+    return;
+  }
+
+  cl::Kernel &propagate = sparse_kernel("sparse_neighbour_propagate");
+  converge({&propagate}, [&] {
+    cl_int err = launch(propagate, cl::NDRange(count * wgw, wgh),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
+}
+
+void GPUFrontierNeighbourPropagation::execute() {
+  int wgw = 32;
+  int wgh = 4;
+  work_group(&wgw, &wgh);
+
+  const size_t count = label_init_sparse(wgw, wgh);
+  if (!count) {
+    return;
+  }
+
+  converge_frontier(sparse_kernel("frontier_neighbour_propagate"), wgw, wgh,
+                    count);
+}
+
+void GPUNeighbourPropagation_Localer::execute() {
+  int wgw;
+  int wgh;
+  tile_shape("solve_locally_plus", &wgw, &wgh);
   const int wsize = round_to_nearest(width, wgw);
   const int hsize = round_to_nearest(height, wgh);
 
-  cl::Kernel startlabel(*program, "label_with_id", &err);
-  CHECKERR;
-  cl::Kernel localer(*program, "solve_locally_plus", &err);
-  CHECKERR;
-  cl::Kernel propagate(*program, "union_find", &err);
-  CHECKERR;
+  cl::Kernel &localer = kernel("solve_locally_plus");
+  cl::Kernel &propagate = kernel("neighbour_propagate");
 
-  err = startlabel.setArg(0, *buf);
-  CHECKERR;
-  err = startlabel.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = startlabel.setArg(2, (cl_int)height);
-  CHECKERR;
+  label_init(cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh));
 
-  err = localer.setArg(0, *buf);
-  CHECKERR;
-  err = localer.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = localer.setArg(2, (cl_int)height);
-  CHECKERR;
+  converge({&propagate}, [&] {
+    cl_int err = launch(localer, cl::NDRange(wsize, hsize),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+    err = launch(propagate, cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
+}
 
-  char changed = 1;
-  cl::Buffer chan(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
-  queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
+void GPUPlusPropagation::execute() {
+  int wgw = 8;
+  int wgh = 8;
+  work_group(&wgw, &wgh);
+  const int wsize = round_to_nearest(width, wgw);
+  const int hsize = round_to_nearest(height, wgh);
 
-  err = propagate.setArg(0, *buf);
-  CHECKERR;
-  err = propagate.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = propagate.setArg(2, (cl_int)height);
-  CHECKERR;
-  err = propagate.setArg(3, chan);
-  CHECKERR;
+  cl::Kernel &propagate = kernel("plus_propagate");
 
-  err = queue->enqueueNDRangeKernel(startlabel, cl::NullRange,
-                                    cl::NDRange(wsize, hsize),
-                                    cl::NDRange(wgw, wgh));
-  CHECKERR;
+  label_init(cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh));
 
-  while (true) {
-    // CPU-GPU sync, sadly
-    queue->enqueueReadBuffer(chan, CL_TRUE, 0, 1, &changed);
-    if (changed == false) {
-      break;
-    }
-    changed = false;
-    queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
-    queue->enqueueNDRangeKernel(localer, cl::NullRange,
-                                cl::NDRange(wsize, hsize),
-                                cl::NDRange(wgw, wgh));
-    queue->enqueueNDRangeKernel(propagate, cl::NullRange,
-                                cl::NDRange(wsize, hsize),
-                                cl::NDRange(wgw, wgh));
+  converge({&propagate}, [&] {
+    cl_int err = launch(propagate, cl::NDRange(wsize, hsize),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
+}
+
+void GPULabelEquivalence::execute() {
+  int wgw = 16;
+  int wgh = 8;
+  work_group(&wgw, &wgh);
+  const int wsize = round_to_nearest(width, wgw);
+  const int hsize = round_to_nearest(height, wgh);
+
+  cl::Kernel &neighbours = kernel("equivalence_scan");
+  cl::Kernel &jump = kernel("equivalence_jump");
+
+  label_init(cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh));
+
+  converge({&neighbours}, [&] {
+    cl_int err = launch(neighbours, cl::NDRange(wsize, hsize),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+    err = launch(jump, cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
+}
+
+void GPUUnionFind::execute() {
+  int wgw = 16;
+  int wgh = 8;
+  work_group(&wgw, &wgh);
+  const int wsize = round_to_nearest(width, wgw);
+  const int hsize = round_to_nearest(height, wgh);
+
+  cl::Kernel &propagate = kernel("union_find");
+
+  label_init(cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh), false);
+
+  converge({&propagate}, [&] {
+    cl_int err = launch(propagate, cl::NDRange(wsize, hsize),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
+}
+
+void GPUSparseUnionFind::execute() {
+  int wgw = 16;
+  int wgh = 8;
+  work_group(&wgw, &wgh);
+
+  const size_t count = label_init_sparse(wgw, wgh, false);
+  if (!count) {
+    return;
   }
+
+  cl::Kernel &propagate = sparse_kernel("sparse_union_find");
+  converge({&propagate}, [&] {
+    cl_int err = launch(propagate, cl::NDRange(count * wgw, wgh),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
 }
 
-void GPULineEditing::execute() {
-  cl_int err;
+void GPUUnionFind_Localer::execute() {
+  int wgw;
+  int wgh;
+  tile_shape("solve_locally_plus", &wgw, &wgh);
+  const int wsize = round_to_nearest(width, wgw);
+  const int hsize = round_to_nearest(height, wgh);
 
-  const int wgs = 2;
-  const int wsize = round_to_nearest(width, wgs);
-  const int hsize = round_to_nearest(height, wgs);
+  cl::Kernel &localer = kernel("solve_locally_plus");
+  cl::Kernel &propagate = kernel("union_find");
 
-  cl::Kernel startlabel(*program, "label_with_id", &err);
-  CHECKERR;
-  cl::Kernel up(*program, "lineedit_up", &err);
-  CHECKERR;
-  cl::Kernel down(*program, "lineedit_down", &err);
-  CHECKERR;
-  cl::Kernel left(*program, "lineedit_left", &err);
-  CHECKERR;
-  cl::Kernel right(*program, "lineedit_right", &err);
-  CHECKERR;
+  label_init(cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh), false);
 
-  err = startlabel.setArg(0, *buf);
-  CHECKERR;
-  err = startlabel.setArg(1, (cl_uint)width);
-  CHECKERR;
-  err = startlabel.setArg(2, (cl_uint)height);
-  CHECKERR;
+  converge({&propagate}, [&] {
+    cl_int err = launch(localer, cl::NDRange(wsize, hsize),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+    err = launch(propagate, cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
+}
 
-  char changed = 1;
-  cl::Buffer chan(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
-  queue->enqueueWriteBuffer(chan, CL_TRUE, 0, 1, &changed);
+size_t GPUBatchUnionFind::lay_out(
+    const std::vector<const LabelData *> &inputs) {
+  images.clear();
+  max_width = 0;
+  max_height = 0;
+  relabeled = false;
+  size_t total = 0;
+  for (auto *l : inputs) {
+    images.push_back(total);
+    images.push_back(l->width);
+    images.push_back(l->height);
+    max_width = std::max(max_width, l->width);
+    max_height = std::max(max_height, l->height);
+    total += l->width * l->height;
+  }
+  return total;
+}
 
-  err = up.setArg(0, *buf);
-  CHECKERR;
-  err = up.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = up.setArg(2, (cl_int)height);
-  CHECKERR;
-  err = up.setArg(3, chan);
-  CHECKERR;
+void GPUBatchUnionFind::copy_to_batch(
+    const std::vector<const LabelData *> &inputs, cl::Context *c,
+    cl::Program *p, cl::CommandQueue *q) {
+  const size_t total = lay_out(inputs);
+
+  if (inputs.size() == 1) {
+    GPUBase::copy_to(inputs[0], c, p, q);
+  } else {
+    // As a single row, which label_init and relabel see as any other image.
+    LabelData packed(total, 1);
+    auto *out = packed.data;
+    for (auto *l : inputs) {
+      out = std::copy(l->data, l->data + l->width * l->height, out);
+    }
+    GPUBase::copy_to(&packed, c, p, q);
+  }
 
-  err = down.setArg(0, *buf);
-  CHECKERR;
-  err = down.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = down.setArg(2, (cl_int)height);
-  CHECKERR;
-  err = down.setArg(3, chan);
+  const size_t size = images.size() * sizeof(cl_int);
+  cl_int err = queue->enqueueWriteBuffer(scratch("images", size), CL_TRUE, 0,
+                                         size, images.data(), nullptr,
+                                         track("batch images"));
   CHECKERR;
+}
 
-  err = left.setArg(0, *buf);
-  CHECKERR;
-  err = left.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = left.setArg(2, (cl_int)height);
-  CHECKERR;
-  err = left.setArg(3, chan);
-  CHECKERR;
+void GPUBatchUnionFind::upload(const LabelData *l, cl::Context *c,
+                               cl::Program *p, cl::CommandQueue *q,
+                               cl::CommandQueue *transfer_queue,
+                               cl::Event *uploaded) {
+  lay_out({l});
+  GPUBase::upload(l, c, p, q, transfer_queue, uploaded);
 
-  err = right.setArg(0, *buf);
-  CHECKERR;
-  err = right.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = right.setArg(2, (cl_int)height);
-  CHECKERR;
-  err = right.setArg(3, chan);
+  // images stays as it is until the next upload, which comes after execute.
+  const size_t size = images.size() * sizeof(cl_int);
+  cl_int err = queue->enqueueWriteBuffer(scratch("images", size), CL_FALSE, 0,
+                                         size, images.data(), nullptr,
+                                         track("batch images"));
   CHECKERR;
+}
 
-  err = queue->enqueueNDRangeKernel(
-      startlabel, cl::NullRange,
-      cl::NDRange(round_to_nearest(width, 16), round_to_nearest(height, 16)),
-      cl::NDRange(16, 16));
-  CHECKERR;
+std::vector<LabelData> GPUBatchUnionFind::copy_from_batch() {
+  std::vector<LabelData> ret;
+  if (images.size() == 3) {
+    ret.push_back(GPUBase::copy_from());
+    return ret;
+  }
 
-  while (true) {
-    // CPU-GPU sync, sadly
-    queue->enqueueReadBuffer(chan, CL_TRUE, 0, 1, &changed);
-    if (changed == false) {
-      break;
-    }
-    changed = false;
-    queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
-    queue->enqueueNDRangeKernel(right, cl::NullRange, cl::NDRange(hsize),
-                                cl::NDRange(wgs));
-    queue->enqueueNDRangeKernel(down, cl::NullRange, cl::NDRange(wsize),
-                                cl::NDRange(wgs));
-    queue->enqueueNDRangeKernel(left, cl::NullRange, cl::NDRange(hsize),
-                                cl::NDRange(wgs));
-    queue->enqueueNDRangeKernel(up, cl::NullRange, cl::NDRange(wsize),
-                                cl::NDRange(wgs));
+  LabelData packed = GPUBase::copy_from();
+  for (size_t i = 0; i < images.size(); i += 3) {
+    const LABELTYPE offset = images[i];
+    LabelData l(images[i + 1], images[i + 2]);
+    auto *in = packed.data + offset;
+    // Labels are indices into the whole batch until relabeled.
+    std::transform(in, in + l.width * l.height, l.data, [&](LABELTYPE v) {
+      return v && !relabeled ? v - offset : v;
+    });
+    ret.push_back(std::move(l));
   }
+  return ret;
 }
 
-void GPULookaheadLineEditing::execute() {
-  cl_int err;
+void GPUBatchUnionFind::copy_to(const LabelData *l, cl::Context *c,
+                                cl::Program *p, cl::CommandQueue *q) {
+  copy_to_batch({l}, c, p, q);
+}
 
-  const int wgs = 2;
-  const int wsize = round_to_nearest(width, wgs);
-  const int hsize = round_to_nearest(height, wgs);
+LabelData GPUBatchUnionFind::copy_from() {
+  return std::move(copy_from_batch()[0]);
+}
 
-  cl::Kernel startlabel(*program, "label_with_id", &err);
-  CHECKERR;
-  cl::Kernel right(*program, "lines_right", &err);
-  CHECKERR;
-  cl::Kernel up(*program, "lines_up", &err);
-  CHECKERR;
+void GPUBatchUnionFind::execute() {
+  int wgw = 16;
+  int wgh = 8;
+  work_group(&wgw, &wgh);
+  const size_t count = images.size() / 3;
+
+  cl::Kernel &propagate = kernel("batch_union_find", [&](cl::Kernel &k) {
+    cl_int err = k.setArg(0, *buf);
+    CHECKERR;
+    err = k.setArg(1, scratch("images", images.size() * sizeof(cl_int)));
+    CHECKERR;
+  });
+  // The count may change without anything being reallocated.
+  cl_int err = propagate.setArg(2, (cl_int)count);
+  CHECKERR;
+
+  if (count > 1) {
+    // Packed as a single row, which a 2D range would leave mostly idle, so
+    // the work-groups are laid out along it instead.
+    const int wg = wgw * wgh;
+    label_init(cl::NDRange(round_to_nearest(width, wg)), cl::NDRange(wg),
+               false);
+  } else {
+    label_init(cl::NDRange(round_to_nearest(width, wgw),
+                           round_to_nearest(height, wgh)),
+               cl::NDRange(wgw, wgh), false);
+  }
 
-  err = startlabel.setArg(0, *buf);
-  CHECKERR;
-  err = startlabel.setArg(1, (cl_uint)width);
-  CHECKERR;
-  err = startlabel.setArg(2, (cl_uint)height);
-  CHECKERR;
+  // One launch covers every image, the smaller ones just leave work-items
+  // idle.
+  const cl::NDRange global(round_to_nearest(max_width, wgw),
+                           round_to_nearest(max_height, wgh), count);
+  converge({&propagate}, [&] {
+    cl_int err = launch(propagate, global, cl::NDRange(wgw, wgh, 1));
+    CHECKERR;
+  });
+}
+
+size_t GPUBatchUnionFind::relabel() {
+  relabeled = true;
+  return GPUBase::relabel();
+}
 
-  char changed = 1;
-  cl::Buffer chan(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
-  queue->enqueueWriteBuffer(chan, CL_TRUE, 0, 1, &changed);
+void GPUHybrid::execute() {
+  cl_int err;
+
+  int tw;
+  int th;
+  tile_shape("solve_locally_plus", &tw, &th);
+  const int wsize = round_to_nearest(width, tw);
+  const int hsize = round_to_nearest(height, th);
+  const cl::NDRange global(wsize, hsize);
+  const cl::NDRange local(tw, th);
+
+  // Every tile label has to be the index+2 of a pixel in the tile, which a
+  // first step taking labels from the neighbours would break.
+  label_init(global, local, false);
+  err = launch(kernel("solve_locally_plus"), global, local);
+  CHECKERR;
+
+  // Each pixel on a tile edge pairs with at most 3 across it.
+  const size_t max = 3 * (height * (wsize / tw) + width * (hsize / th));
+  cl::Buffer &pairs = scratch("seam pairs", 2 * max * sizeof(cl_int));
+  cl::Buffer &count = scratch("seam count", sizeof(cl_int));
+  cl::Kernel &seams = kernel("seam_pairs", [&](cl::Kernel &k) {
+    err = k.setArg(0, *buf);
+    CHECKERR;
+    err = k.setArg(1, (cl_int)width);
+    CHECKERR;
+    err = k.setArg(2, (cl_int)height);
+    CHECKERR;
+    err = k.setArg(3, pairs);
+    CHECKERR;
+    err = k.setArg(4, count);
+    CHECKERR;
+    err = k.setArg(5, (cl_int)max);
+    CHECKERR;
+  });
+  const cl_int none = 0;
+  err = queue->enqueueWriteBuffer(count, CL_FALSE, 0, sizeof(cl_int), &none);
+  CHECKERR;
+  err = launch(seams, global, local);
+  CHECKERR;
+
+  cl_int n = 0;
+  err = queue->enqueueReadBuffer(count, CL_TRUE, 0, sizeof(cl_int), &n,
+                                 nullptr, track("seam count"));
+  CHECKERR;
+  if (!n) {
+    return;
+  }
+  std::vector<cl_int> found(2 * n);
+  err = queue->enqueueReadBuffer(pairs, CL_TRUE, 0,
+                                 found.size() * sizeof(cl_int), found.data(),
+                                 nullptr, track("seam pairs"));
+  CHECKERR;
+
+  // The tile labels are sparse, so they get dense ids for the union-find.
+  std::unordered_map<cl_int, LABELTYPE> ids;
+  std::vector<cl_int> labels(1, 0);
+  Equivalence eq;
+  auto id = [&](cl_int label) {
+    auto it = ids.find(label);
+    if (it == ids.end()) {
+      it = ids.emplace(label, eq.add(1) + 1).first;
+      labels.push_back(label);
+    }
+    return it->second;
+  };
+  for (cl_int i = 0; i < n; ++i) {
+    eq.unite(id(found[2 * i]), id(found[2 * i + 1]));
+  }
+
+  // The root pixel of every merged tile label gets the label of the set.
+  std::vector<cl_int> patches;
+  for (LABELTYPE i = 1; i < (LABELTYPE)labels.size(); ++i) {
+    LABELTYPE root = eq.find(i);
+    if (root != i) {
+      patches.push_back(labels[i] - 2);
+      patches.push_back(labels[root]);
+    }
+  }
 
-  err = right.setArg(0, *buf);
+  if (patches.empty()) {
+    return;
+  }
+  const size_t size = patches.size() * sizeof(cl_int);
+  cl::Buffer &patchbuf = scratch("seam patches", size);
+  err = queue->enqueueWriteBuffer(patchbuf, CL_TRUE, 0, size, patches.data(),
+                                  nullptr, track("seam patches"));
   CHECKERR;
-  err = right.setArg(1, (cl_int)width);
+  cl::Kernel &patch = kernel("seam_patch", [&](cl::Kernel &k) {
+    err = k.setArg(0, *buf);
+    CHECKERR;
+    err = k.setArg(1, patchbuf);
+    CHECKERR;
+  });
+  const cl_int npatches = patches.size() / 2;
+  err = patch.setArg(2, npatches);
   CHECKERR;
-  err = right.setArg(2, (cl_int)height);
+  err = launch(patch, cl::NDRange(round_to_nearest(npatches, 64)),
+               cl::NDRange(64));
   CHECKERR;
-  err = right.setArg(3, chan);
+  err = launch(kernel("seam_resolve"), global, local);
   CHECKERR;
+}
 
-  err = up.setArg(0, *buf);
-  CHECKERR;
-  err = up.setArg(1, (cl_int)width);
+void GPUBlockUnionFind::execute() {
+  cl_int err;
+
+  int tw;
+  int th;
+  tile_shape("block_union_find_local", &tw, &th);
+  const cl::NDRange global(round_to_nearest(width, tw),
+                           round_to_nearest(height, th));
+  const cl::NDRange local(tw, th);
+
+  label_init(global, local, false);
+  err = launch(kernel("block_union_find_local"), global, local);
   CHECKERR;
-  err = up.setArg(2, (cl_int)height);
+  err = launch(kernel("block_union_find_merge"), global, local);
   CHECKERR;
-  err = up.setArg(3, chan);
+  err = launch(kernel("block_union_find_flatten"), global, local);
   CHECKERR;
+}
+
+void GPULineEditing::execute() {
+  int wgs = 2;
+  work_group(&wgs);
+  const int wsize = round_to_nearest(width, wgs);
+  const int hsize = round_to_nearest(height, wgs);
+
+  cl::Kernel &up = kernel("lineedit_up");
+  cl::Kernel &down = kernel("lineedit_down");
+  cl::Kernel &left = kernel("lineedit_left");
+  cl::Kernel &right = kernel("lineedit_right");
 
-  err = queue->enqueueNDRangeKernel(
-      startlabel, cl::NullRange,
+  label_init(
       cl::NDRange(round_to_nearest(width, 16), round_to_nearest(height, 16)),
       cl::NDRange(16, 16));
-  CHECKERR;
 
-  while (true) {
-    // CPU-GPU sync, sadly
-    queue->enqueueReadBuffer(chan, CL_TRUE, 0, 1, &changed);
-    if (changed == false) {
-      break;
-    }
-    changed = false;
-    queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
-    queue->enqueueNDRangeKernel(right, cl::NullRange, cl::NDRange(hsize),
-                                cl::NDRange(wgs));
-    queue->enqueueNDRangeKernel(up, cl::NullRange, cl::NDRange(wsize),
-                                cl::NDRange(wgs));
-  }
+  converge({&right, &down, &left, &up}, [&] {
+    cl_int err = launch(right, cl::NDRange(hsize), cl::NDRange(wgs));
+    CHECKERR;
+    err = launch(down, cl::NDRange(wsize), cl::NDRange(wgs));
+    CHECKERR;
+    err = launch(left, cl::NDRange(hsize), cl::NDRange(wgs));
+    CHECKERR;
+    err = launch(up, cl::NDRange(wsize), cl::NDRange(wgs));
+    CHECKERR;
+  });
 }
 
-void GPUStackOnePass::execute() {
-  cl_int err;
+void GPULookaheadLineEditing::execute() {
+  int wgs = 2;
+  work_group(&wgs);
+  const int wsize = round_to_nearest(width, wgs);
+  const int hsize = round_to_nearest(height, wgs);
 
-  const int wgw = 32;
-  const int wgh = 2;
-  const int wsize = round_to_nearest(width, wgw);
-  const int hsize = round_to_nearest(height, wgh);
+  cl::Kernel &right = kernel("lines_right");
+  cl::Kernel &up = kernel("lines_up");
 
-  cl::Kernel startlabel(*program, "label_with_id", &err);
-  CHECKERR;
-  cl::Kernel propagate(*program, "recursively_win", &err);
-  CHECKERR;
+  label_init(
+      cl::NDRange(round_to_nearest(width, 16), round_to_nearest(height, 16)),
+      cl::NDRange(16, 16));
 
-  err = startlabel.setArg(0, *buf);
-  CHECKERR;
-  err = startlabel.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = startlabel.setArg(2, (cl_int)height);
-  CHECKERR;
+  converge({&right, &up}, [&] {
+    cl_int err = launch(right, cl::NDRange(hsize), cl::NDRange(wgs));
+    CHECKERR;
+    err = launch(up, cl::NDRange(wsize), cl::NDRange(wgs));
+    CHECKERR;
+  });
+}
 
-  char changed = 1;
-  cl::Buffer chan(*context, CL_MEM_READ_WRITE, (size_t)1, nullptr, &err);
-  queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
+void GPUStackOnePass::execute() {
+  int wgw = 32;
+  int wgh = 2;
+  work_group(&wgw, &wgh);
+  const int wsize = round_to_nearest(width, wgw);
+  const int hsize = round_to_nearest(height, wgh);
 
-  err = propagate.setArg(0, *buf);
-  CHECKERR;
-  err = propagate.setArg(1, (cl_int)width);
-  CHECKERR;
-  err = propagate.setArg(2, (cl_int)height);
-  CHECKERR;
-  err = propagate.setArg(3, chan);
-  CHECKERR;
+  cl::Kernel &propagate = kernel("recursively_win");
 
-  err = queue->enqueueNDRangeKernel(startlabel, cl::NullRange,
-                                    cl::NDRange(wsize, hsize),
-                                    cl::NDRange(wgw, wgh));
-  CHECKERR;
+  label_init(cl::NDRange(wsize, hsize), cl::NDRange(wgw, wgh));
 
-  while (true) {
-    // CPU-GPU sync, sadly
-    queue->enqueueReadBuffer(chan, CL_TRUE, 0, 1, &changed);
-    if (changed == false) {
-      break;
-    }
-    changed = false;
-    queue->enqueueWriteBuffer(chan, CL_FALSE, 0, 1, &changed);
-    queue->enqueueNDRangeKernel(propagate, cl::NullRange,
-                                cl::NDRange(wsize, hsize),
-                                cl::NDRange(wgw, wgh));
-  }
+  converge({&propagate}, [&] {
+    cl_int err = launch(propagate, cl::NDRange(wsize, hsize),
+                        cl::NDRange(wgw, wgh));
+    CHECKERR;
+  });
 }
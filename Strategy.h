@@ -2,7 +2,12 @@
 #define STRATEGY_H
 
 #include <CL/cl.hpp>
+#include <deque>
+#include <functional>
 #include "LabelData.h"
+#include "utilityCL.h"
+
+class Tuning;
 
 /**
  * ABC representing a strategy for solving CCL.
@@ -36,6 +41,19 @@ public:
    */
   virtual void execute() = 0;
 
+  /**
+   * Optional, between execute and copy_from.  Renumbers the labels to 1..N in
+   * raster order of the first pixel of each component, and returns N.  Note
+   * that 1 is then an actual label, see valid_result.
+   */
+  virtual size_t relabel() = 0;
+
+  /**
+   * Optional, between execute and copy_from.  Relabels as above and returns
+   * the statistics of every component, indexed by label-1.
+   */
+  virtual std::vector<ComponentStats> statistics() = 0;
+
   /**
    * Clean up memory objects and return the results.
    */
@@ -47,6 +65,11 @@ public:
 
 /**
  * ABC for cpu algorithms that simply keep a local LabelData.
+ *
+ * The algorithms deriving from this take the connectivity, 4 or 8, as the
+ * template parameter CONN.  It is only ever compared against constants, so the
+ * 4-connected scans compile to the same code as without the 8-connected
+ * neighbours.  Both are instantiated in Strategy.cc.
  */
 class CPUBase : public Strategy {
 protected:
@@ -56,6 +79,14 @@ public:
   virtual void copy_to(const LabelData *, cl::Context *, cl::Program *,
                        cl::CommandQueue *);
   virtual LabelData copy_from();
+
+  /**
+   * Multithreaded, over chunks of pixels.  The first pixel of every label is
+   * found with an atomic minimum, after which the first pixels are counted
+   * per chunk to get the new labels.
+   */
+  virtual size_t relabel();
+  virtual std::vector<ComponentStats> statistics();
   virtual ~CPUBase() {}
 };
 
@@ -74,7 +105,7 @@ public:
  * One-pass algorithm, explores entire components at a time.
  * Uses a queue to record pixels to be explored, and propagates thusly.
  */
-class CPUOnePass : public CPUBase {
+template <int CONN = 4> class CPUOnePass : public CPUBase {
 public:
   virtual std::string name() { return "CPU One-pass"; }
   virtual void execute();
@@ -85,11 +116,80 @@ public:
  * Equivalences are recorded inside the labeling themselves, similar to the gpu
  * version.
  */
-class CPUUnionFind : public CPUBase {
+template <int CONN = 4> class CPUUnionFind : public CPUBase {
 public:
   virtual std::string name() { return "CPU Union-find"; }
   virtual void execute();
   int find_set(int location);
+
+  /**
+   * Hooks the larger of the two roots onto the smaller.
+   */
+  void unite(int a, int b);
+};
+
+/**
+ * Union-find as above, but split into horizontal bands that are labeled on
+ * their own thread.  Equivalences along the seams between bands are merged
+ * serially afterwards, which only touches one row per seam, and the flattening
+ * pass is again done per band in parallel.
+ */
+template <int CONN = 4> class CPUParallelUnionFind : public CPUBase {
+private:
+  size_t threads;
+
+  /**
+   * Like CPUUnionFind::find_set, but stops as soon as the path leaves the
+   * band [begin, end).  After the seam merge every root outside of a band is
+   * already a final root, so no thread has to read another band's pixels.
+   */
+  int find_set(int location, int begin, int end);
+  int find_set(int location);
+
+  /**
+   * Hooks the larger of the two roots onto the smaller, returning the root
+   * that got hooked or -1 if they already were the same.
+   */
+  int unite(int a, int b);
+
+  void label_band(size_t ybegin, size_t yend);
+  void flatten_band(size_t ybegin, size_t yend);
+
+public:
+  /**
+   * Zero threads picks one per hardware thread.
+   */
+  CPUParallelUnionFind(size_t threads = 0) : threads(threads){};
+  virtual std::string name() { return "CPU Parallel union-find"; }
+  virtual void execute();
+};
+
+/**
+ * Union-find over horizontal runs of foreground instead of over pixels.
+ * The first pass extracts the runs of every row, uniting each with the runs
+ * it overlaps in the row above.  The second pass writes the label of each
+ * run's root to all of its pixels at once.  Labels are the root run's index+2.
+ */
+template <int CONN = 4> class CPURunUnionFind : public CPUBase {
+private:
+  struct Run {
+    // Pixels [start, end) of its row.
+    int start;
+    int end;
+    int parent;
+  };
+  std::vector<Run> runs;
+  // Index of the first run of each row, and one past the last.
+  std::vector<size_t> row_start;
+
+  int find_set(int run);
+  void extract_runs(const LABELTYPE *row, int w);
+
+public:
+  virtual std::string name() { return "CPU Run-based union-find"; }
+  virtual void execute();
+  virtual void copy_to(const LabelData *, cl::Context *, cl::Program *,
+                       cl::CommandQueue *);
 };
 
 /**
@@ -110,14 +210,24 @@ public:
  * Since all the label relations are taken care of in the first scan
  * the 2nd scan simply assigns the correct label to all the pixels
  */
-class CPULinearTwoScan : public CPUBase {
-private:
+template <int CONN = 4> class CPULinearTwoScan : public CPUBase {
+protected:
   std::vector<unsigned int> rl_table;
   // Next
   std::vector<unsigned int> n_label;
   // Tail
   std::vector<unsigned int> t_label;
 
+  /**
+   * Records m as a new provisional label, in a set of its own.
+   */
+  void new_label(unsigned int m);
+
+  /**
+   * Joins the sets of the provisional labels a and b, 0 is ignored.
+   */
+  void merge(unsigned int a, unsigned int b);
+
 public:
   virtual std::string name() { return "CPU Linear two-scan"; }
   virtual void execute();
@@ -125,6 +235,24 @@ public:
                        cl::CommandQueue *);
 };
 
+/**
+ * Two-pass algorithm working on 2x2 blocks of pixels, after Grana, Borghesani
+ * and Cucchiara, using the label tables of the linear two-scan above.
+ *
+ * The foreground pattern of a block decides, through a precomputed table, how
+ * many connected parts the block holds (two only for the diagonal patterns
+ * with 4-connectivity, always one with 8) and which of the already labeled
+ * pixels above and to the left each part has to look at.  Every part then gets
+ * a single provisional label, so both the neighbour reads and the number of
+ * provisional labels drop to about a quarter of the pixel-based scan.
+ */
+template <int CONN = 4>
+class CPUBlockTwoScan : public CPULinearTwoScan<CONN> {
+public:
+  virtual std::string name() { return "CPU Block two-scan"; }
+  virtual void execute();
+};
+
 /**
  * Multipass algorithm as proposed by Kenji Suzuki, Isao Horiba and Noboru
  * Sugie.
@@ -135,10 +263,16 @@ public:
  * are done until no more change in result is seen. Theses subsequent scans
  * are done in pairs of one backwards and one forwards scan.
  */
-class CPUFrontBack : public CPUBase {
+template <int CONN = 4> class CPUFrontBack : public CPUBase {
 private:
   std::vector<int> labelConnT;
 
+  /**
+   * Writes the nonzero labels of the neighbours already passed in the given
+   * scan direction to n, returning how many there were.
+   */
+  int neighbours(size_t x, size_t y, bool forward, int *n);
+
 public:
   virtual std::string name() { return "CPU Front back scan"; }
   virtual void execute();
@@ -148,15 +282,118 @@ public:
 
 /**
  * ABC for GPU algorithms that keep a cl::Buffer and queues work.
+ *
+ * The buffer, kernels and any scratch buffers are kept between executions,
+ * so labeling many same-sized images does not allocate or create anything
+ * after the first.  They are only remade when the context, program or size
+ * changes.
  */
 class GPUBase : public Strategy {
+public:
+  /**
+   * How the iterative algorithms check for convergence.  Blocking reads the
+   * flag back after every iteration.  Batched queues batches of iterations
+   * between checks and reads the flags of the batches back without blocking,
+   * such that the queue never runs dry waiting for the host.  The batches are
+   * sized by how many iterations the previous run needed, and grow while they
+   * keep changing things beyond that.  It may run a few iterations more than
+   * needed.
+   */
+  enum class Convergence { Blocking, Batched };
+  Convergence convergence = Convergence::Batched;
+
+  /**
+   * How labels get to and from the device.  Both send the input as a byte
+   * per pixel that the first kernel labels from.  Copy reads the labels back
+   * from a device buffer.  Map lets the buffer use host memory of our own,
+   * with CL_MEM_USE_HOST_PTR, which copy_from maps and hands out as the
+   * result, without any transfer or copy on devices sharing memory with the
+   * host.  Auto picks Map for those devices, by
+   * CL_DEVICE_HOST_UNIFIED_MEMORY.  The tester's -M compares the two.
+   */
+  enum class Transfer { Auto, Copy, Map };
+  Transfer transfer = Transfer::Auto;
+
+  /**
+   * When set, the program passed to copy_to is replaced by the variant for
+   * the size of the image, see ProgramVariants.
+   */
+  ProgramVariants *variants = nullptr;
+
+  /**
+   * When set, the tunable strategies take the shape of their work-groups
+   * from it rather than their defaults, see Tuning.
+   */
+  Tuning *tuning = nullptr;
+
+  /**
+   * The kernel whose work-group shape execute lets be tuned, empty if the
+   * strategy has none, like the local ones which need their tile shape.
+   */
+  virtual std::string tuned_kernel() { return ""; }
+
+  /**
+   * Dimensions of the tuned work-groups, 1 or 2.
+   */
+  virtual int tuned_dims() { return 2; }
+
+  /**
+   * CL_KERNEL_WORK_GROUP_SIZE and
+   * CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE of tuned_kernel, once
+   * copy_to has been called.
+   */
+  size_t max_work_group();
+  size_t preferred_multiple();
+
+  /**
+   * Overrides both the tuning and the default work-group shape, while
+   * tuning.  0 means no override.
+   */
+  void force_work_group(int x, int y);
+
+  /**
+   * Device side timings of the last run, from copy_to up to now.  Only
+   * gathered when the queue was created with profiling enabled, see
+   * load_queue.
+   */
+  struct Profile {
+    struct Entry {
+      size_t count = 0;
+      // Summed over every call, between start and end of the command.
+      double ms = 0;
+      // Summed over every call, between queueing and start of the command.
+      double latency_ms = 0;
+    };
+    // By kernel name.
+    std::map<std::string, Entry> kernels;
+    // By what was transferred.
+    std::map<std::string, Entry> transfers;
+    // Iterations run by converge.
+    size_t iterations = 0;
+  };
+
+  /**
+   * Waits for everything recorded and collects it into a Profile.
+   */
+  Profile profile();
+
 protected:
   /**
    * Data corresponding to a LabelData, but in gpu.
    */
   cl::Buffer *buf = nullptr;
-  size_t width;
-  size_t height;
+  size_t buf_size = 0;
+  // Backs buf in the Map mode until copy_from hands it out, empty otherwise.
+  LabelData host;
+  // Whether the device of the queue shares memory with the host.
+  bool unified = false;
+  // Whether buf still has to be labeled from the uploaded mask.
+  bool from_mask = false;
+  // Uploads from upload() that label_init has to wait for.
+  std::vector<cl::Event> pending_upload;
+  std::vector<unsigned char> mask_host;
+  size_t width = 0;
+  size_t height = 0;
 
   /**
    * Necessary to create kernel, buffer and queue work.
@@ -165,11 +402,186 @@ protected:
   cl::Program *program = nullptr;
   cl::CommandQueue *queue = nullptr;
 
+  /**
+   * Runs iteration, which enqueues a single iteration, until one changes
+   * nothing.  The kernels in flagged get the changed flag as their argument 3.
+   */
+  void converge(std::initializer_list<cl::Kernel *> flagged,
+                const std::function<void()> &iteration);
+
+  /**
+   * Gives every foreground pixel its index+2 as label, over the given ranges.
+   * When copy_to only uploaded the mask, the labels are made from it instead,
+   * and unless first_step is false that already takes the smallest index of
+   * the neighbours, saving a first propagation.  Only strategies that
+   * propagate minimums can start from that, union-find needs every pixel to
+   * be its own root.
+   */
+  void label_init(const cl::NDRange &global, const cl::NDRange &local,
+                  bool first_step = true);
+
+  /**
+   * As label_init over tiles of tw*th, the work-group size, after which the
+   * tiles holding any foreground are listed in raster order for
+   * sparse_kernel.  Each tile is flagged on the device, and the flags are
+   * compacted with scan, so only the number of listed tiles is read back and
+   * returned.  Launching a work-group per listed tile skips the background
+   * tiles entirely, which is most of the image for sparse ones.
+   */
+  size_t label_init_sparse(int tw, int th, bool first_step = true);
+
+  /**
+   * As kernel, for the named kernel taking the tile list of
+   * label_init_sparse as its argument 4.  It has to be launched with
+   * work-groups of the tile size, one per listed tile.
+   */
+  cl::Kernel &sparse_kernel(const std::string &name);
+
+  /**
+   * As converge, for k from sparse_kernel over the count tiles listed by
+   * label_init_sparse, but with a changed flag per tile as argument 3.  After
+   * every iteration the occupied tiles that changed, or have a neighbour that
+   * did, are listed the same way, and only they are launched next, until
+   * none changed.  Only for kernels that read nothing beyond the neighbouring
+   * pixels.  Reading back the length of the list blocks every iteration.
+   */
+  void converge_frontier(cl::Kernel &k, int tw, int th, size_t count);
+
+  /**
+   * The kernel with the given name, created once per program.  bind sets its
+   * arguments, and is only called again once a buffer or the size has changed
+   * since.  By default buf, width and height are bound as arguments 0 to 2.
+   */
+  cl::Kernel &kernel(const std::string &name,
+                     const std::function<void(cl::Kernel &)> &bind = nullptr);
+
+  /**
+   * A device buffer of at least size bytes, kept under the given name.  It is
+   * only reallocated when a larger one is asked for.
+   */
+  cl::Buffer &scratch(const std::string &name, size_t size);
+
+  /**
+   * The shape of the tuned work-groups.  x and y hold the defaults, and are
+   * replaced by the forced or tuned shape, if any.  y is left out for one
+   * dimension.  A tuned shape the kernel can't be launched with, as when it
+   * was tuned with another driver, leaves the defaults.
+   */
+  void work_group(int *x, int *y = nullptr);
+
+  /**
+   * Whether tuned_kernel can be launched with x by y work-groups on the
+   * device of the queue.
+   */
+  bool legal_work_group(int x, int y);
+
+  /**
+   * The tile shape the named kernel was built for, TILE_W and TILE_H of
+   * kernel.cl, from its reqd_work_group_size.  Its work-groups have to be of
+   * exactly that shape.
+   */
+  void tile_shape(const std::string &name, int *x, int *y);
+
+  /**
+   * Enqueues k over the given ranges on queue, recording it for profile when
+   * profiling.
+   */
+  cl_int launch(cl::Kernel &k, const cl::NDRange &global,
+                const cl::NDRange &local);
+
+  /**
+   * An event to pass to a transfer on queue, or on a transfer queue made
+   * alike, such that profile records it under the given name, or nullptr
+   * when not profiling.
+   */
+  cl::Event *track(const std::string &name);
+
+private:
+  struct CachedKernel {
+    cl::Kernel kernel;
+    // Value of generation when the arguments were bound.
+    size_t generation = 0;
+  };
+  struct Scratch {
+    cl::Buffer buffer;
+    size_t size = 0;
+  };
+  std::map<std::string, CachedKernel> kernels;
+  std::map<std::string, Scratch> scratches;
+  // The convergence flags.
+  std::vector<cl::Buffer> chans;
+  // Bumped whenever a buffer is reallocated or the size changes.
+  size_t generation = 1;
+  // Whether queue has profiling enabled, and what was recorded since copy_to.
+  bool profiling = false;
+  struct Tracked {
+    std::string name;
+    bool kernel;
+    cl::Event event;
+  };
+  std::deque<Tracked> tracked;
+  size_t iterations = 0;
+  // Iterations the last batched converge needed at most, 0 if unknown or
+  // the size has changed since.
+  size_t expected = 0;
+  // Room for this many tiles in the tile list of label_init_sparse.
+  size_t sparse_tiles = 0;
+  // From force_work_group.
+  int forced_x = 0;
+  int forced_y = 0;
+
+  /**
+   * The part of copy_to that doesn't transfer anything.  Updates the cached
+   * state, makes sure buf fits, on memory of our own if allow_map and the
+   * transfer mode says so, and prepares the mask to upload.
+   */
+  void prepare(const LabelData *l, cl::Context *c, cl::Program *p,
+               cl::CommandQueue *q, bool allow_map);
+
+  /**
+   * Inclusive prefix sum of the n ints in data, in place.  Blocks are scanned
+   * in local memory, and the block totals are scanned recursively and added
+   * back.
+   */
+  void scan(cl::Buffer *data, size_t n, int level = 0);
+
 public:
   virtual void copy_to(const LabelData *, cl::Context *, cl::Program *,
                        cl::CommandQueue *);
   virtual LabelData copy_from();
-  virtual ~GPUBase() {}
+
+  /**
+   * As copy_to, always copying, but without blocking and on transfer_queue.
+   * execute waits for uploaded on q before it starts.  l may be reused as
+   * soon as this returns.
+   */
+  virtual void upload(const LabelData *l, cl::Context *c, cl::Program *p,
+              cl::CommandQueue *q, cl::CommandQueue *transfer_queue,
+              cl::Event *uploaded);
+
+  /**
+   * As copy_from, but without blocking and on transfer_queue, once what has
+   * been queued so far is done.  out is resized to fit if needed, and must
+   * not be touched before downloaded completes.
+   */
+  void download(LabelData *out, cl::CommandQueue *transfer_queue,
+                cl::Event *downloaded);
+
+  /**
+   * Flags the first pixel of every label, found with atomic_min, and prefix
+   * sums the flags to get the new labels.  Only N is read back.  Assumes the
+   * labels are at most the largest index+2, as they all start from
+   * label_with_id.
+   */
+  virtual size_t relabel();
+
+  /**
+   * Accumulates into a compact array of N entries with atomics, so only that
+   * array is read back.  The coordinate sums for the centroids are kept as 64
+   * bits split over two uints.
+   */
+  virtual std::vector<ComponentStats> statistics();
+  virtual ~GPUBase();
 };
 
 /**
@@ -179,6 +591,30 @@ class GPUNeighbourPropagation : public GPUBase {
 public:
   virtual std::string name() { return "GPU Neighbour propagation"; }
   virtual void execute();
+  virtual std::string tuned_kernel() { return "neighbour_propagate"; }
+};
+
+/**
+ * Neighbour propagation over only the tiles holding any foreground, see
+ * GPUBase::label_init_sparse.
+ */
+class GPUSparseNeighbourPropagation : public GPUBase {
+public:
+  virtual std::string name() { return "GPU Neighbour propagation sparse"; }
+  virtual void execute();
+  virtual std::string tuned_kernel() { return "sparse_neighbour_propagate"; }
+};
+
+/**
+ * Sparse neighbour propagation that, after the first iteration, only
+ * revisits the tiles where labels changed and their neighbours, see
+ * GPUBase::converge_frontier.
+ */
+class GPUFrontierNeighbourPropagation : public GPUBase {
+public:
+  virtual std::string name() { return "GPU Neighbour propagation frontier"; }
+  virtual void execute();
+  virtual std::string tuned_kernel() { return "frontier_neighbour_propagate"; }
 };
 
 /**
@@ -198,6 +634,22 @@ class GPUPlusPropagation : public GPUBase {
 public:
   virtual std::string name() { return "GPU Plus propagation"; }
   virtual void execute();
+  virtual std::string tuned_kernel() { return "plus_propagate"; }
+};
+
+/**
+ * Label equivalence.  Every iteration scans for the smallest label next to
+ * each pixel and hooks the root of the pixel's label onto it with atomic_min,
+ * then lets every pixel jump along the labels to their root.  Uses the same
+ * index+2 roots as union-find, and needs a number of iterations about
+ * logarithmic in the length of the components, where the propagating
+ * strategies need one per pixel of it.
+ */
+class GPULabelEquivalence : public GPUBase {
+public:
+  virtual std::string name() { return "GPU Label equivalence"; }
+  virtual void execute();
+  virtual std::string tuned_kernel() { return "equivalence_scan"; }
 };
 
 /**
@@ -212,6 +664,18 @@ class GPUUnionFind : public GPUBase {
 public:
   virtual std::string name() { return "GPU Union-find"; }
   virtual void execute();
+  virtual std::string tuned_kernel() { return "union_find"; }
+};
+
+/**
+ * Union-find over only the tiles holding any foreground, see
+ * GPUBase::label_init_sparse.
+ */
+class GPUSparseUnionFind : public GPUBase {
+public:
+  virtual std::string name() { return "GPU Union-find sparse"; }
+  virtual void execute();
+  virtual std::string tuned_kernel() { return "sparse_union_find"; }
 };
 
 /**
@@ -223,6 +687,90 @@ public:
   virtual void execute();
 };
 
+/**
+ * Union-find over a batch of images at once.  copy_to_batch packs them one
+ * after another into a single buffer, with the offset, width and height of
+ * each in a small table, and every iteration is one launch over the whole
+ * batch with a single changed flag.  That saves the launches and flag reads
+ * per image that dominate for many small images.  A single image through
+ * copy_to is a batch of one, and everything else works on it as usual.
+ */
+class GPUBatchUnionFind : public GPUBase {
+  // Offset, width and height of every image in the batch.
+  std::vector<cl_int> images;
+  size_t max_width = 0;
+  size_t max_height = 0;
+  // Whether the labels are compact over the whole batch.
+  bool relabeled = false;
+
+  /**
+   * Fills images and the largest size for inputs, packed one after another,
+   * and returns the total number of pixels.
+   */
+  size_t lay_out(const std::vector<const LabelData *> &inputs);
+
+public:
+  virtual std::string name() { return "GPU Batch union-find"; }
+
+  /**
+   * Uploads all of inputs as one batch.  A batch of one is uploaded as is, a
+   * larger one is packed as a single row.
+   */
+  void copy_to_batch(const std::vector<const LabelData *> &inputs,
+                     cl::Context *c, cl::Program *p, cl::CommandQueue *q);
+
+  /**
+   * The labels of each image in the batch, each with its own index+2 as
+   * after a single image.  After relabel they are instead 1..N over the
+   * whole batch, numbered in the order of the images.
+   */
+  std::vector<LabelData> copy_from_batch();
+
+  virtual void copy_to(const LabelData *, cl::Context *, cl::Program *,
+                       cl::CommandQueue *);
+  virtual LabelData copy_from();
+  /**
+   * As a batch of one, such that the strategy can be pipelined.
+   */
+  virtual void upload(const LabelData *l, cl::Context *c, cl::Program *p,
+                      cl::CommandQueue *q, cl::CommandQueue *transfer_queue,
+                      cl::Event *uploaded);
+  virtual void execute();
+  virtual std::string tuned_kernel() { return "batch_union_find"; }
+
+  /**
+   * As GPUBase::relabel, over the whole batch.  statistics only make sense
+   * for a batch of one, as a larger one is a single row to it.
+   */
+  virtual size_t relabel();
+};
+
+/**
+ * Labels every tile on the device with solve_locally_plus, and merges the
+ * tiles on the host.  The device only reports the pairs of labels that touch
+ * across tile edges, which the host unites and sends back as the label each
+ * tile label should take, applied on the device with a single pointer jump.
+ * There is no iteration over the whole image at all.
+ */
+class GPUHybrid : public GPUBase {
+public:
+  virtual std::string name() { return "GPU Hybrid tiles + host merge"; }
+  virtual void execute();
+};
+
+/**
+ * Union-find in three fixed passes, with no iteration until convergence.
+ * Every tile is first labeled on its own in local memory, then the tile labels
+ * touching across tile edges are united in global memory by hooking roots
+ * with atomic_min, and finally every pixel is pointed straight at its root.
+ * The number of launches is the same whatever the shape of the components.
+ */
+class GPUBlockUnionFind : public GPUBase {
+public:
+  virtual std::string name() { return "GPU Block union-find"; }
+  virtual void execute();
+};
+
 /**
  * Traverses row/column forward/backwards and edits at the same time.
  */
@@ -230,6 +778,8 @@ class GPULineEditing : public GPUBase {
 public:
   virtual std::string name() { return "GPU Line editing"; }
   virtual void execute();
+  virtual std::string tuned_kernel() { return "lineedit_right"; }
+  virtual int tuned_dims() { return 1; }
 };
 
 /**
@@ -239,6 +789,8 @@ class GPULookaheadLineEditing : public GPUBase {
 public:
   virtual std::string name() { return "GPU Lookahead line editing"; }
   virtual void execute();
+  virtual std::string tuned_kernel() { return "lines_right"; }
+  virtual int tuned_dims() { return 1; }
 };
 
 /**
@@ -252,6 +804,7 @@ class GPUStackOnePass : public GPUBase {
 public:
   virtual std::string name() { return "GPU Stack-based"; }
   virtual void execute();
+  virtual std::string tuned_kernel() { return "recursively_win"; }
 };
 
 #endif /* end of include guard: STRATEGY_H */
@@ -0,0 +1,136 @@
+#include "Streaming.h"
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include "Equivalence.h"
+
+size_t StripLabeler::label(const std::string &input, const std::string &output,
+                           bool (*threshold_function)(unsigned char r,
+                                                      unsigned char g,
+                                                      unsigned char b,
+                                                      unsigned char a),
+                           RGBA (*img_fun)(LABELTYPE in)) {
+  iml::RowReader reader(input);
+  if (!reader) {
+    fail("Image not opened correctly for streaming.");
+  }
+  const size_t w = reader.width();
+  const size_t h = reader.height();
+
+  std::string partname = output + ".part";
+  FILE *part = fopen(partname.c_str(), "w+b");
+  if (!part) {
+    fail("Couldn't create temporary label file.");
+  }
+
+  Equivalence eq;
+  std::vector<unsigned char> rgba(w * 4);
+  // Provisional labels of the last row of the previous strip.
+  std::vector<LABELTYPE> above(w, 0);
+
+  for (size_t ystart = 0; ystart < h; ystart += strip_height) {
+    const size_t sh = std::min(strip_height, h - ystart);
+
+    LabelData strip(w, sh);
+    for (size_t y = 0; y < sh; ++y) {
+      if (!reader.read_row(rgba.data())) {
+        fail("Failed reading image row.");
+      }
+      const unsigned char *in = rgba.data();
+      for (size_t x = 0; x < w; ++x) {
+        strip.data[w * y + x] = threshold_function(in[0], in[1], in[2], in[3]);
+        in += 4;
+      }
+    }
+
+    strategy->copy_to(&strip, context, program, queue);
+    strategy->execute();
+    size_t n = strategy->relabel();
+    strip = strategy->copy_from();
+
+    LABELTYPE offset = eq.add(n);
+    LABELTYPE *d = strip.data;
+    for (size_t i = 0; i < w * sh; ++i) {
+      if (d[i]) {
+        d[i] += offset;
+      }
+    }
+
+    // Merge along the seam.  Neighbours within the row above already share a
+    // set, so the diagonals only matter when straight above is background.
+    if (ystart) {
+      for (size_t x = 0; x < w; ++x) {
+        if (!d[x]) {
+          continue;
+        }
+        if (above[x]) {
+          eq.unite(d[x], above[x]);
+        } else if (connectivity == 8) {
+          if (x > 0) {
+            eq.unite(d[x], above[x - 1]);
+          }
+          if (x + 1 < w) {
+            eq.unite(d[x], above[x + 1]);
+          }
+        }
+      }
+    }
+    std::copy(d + w * (sh - 1), d + w * sh, above.begin());
+
+    if (fwrite(d, sizeof(LABELTYPE), w * sh, part) != w * sh) {
+      fail("Failed writing temporary label file.");
+    }
+  }
+
+  size_t count;
+  std::vector<LABELTYPE> table = eq.resolve(&count);
+  rewind(part);
+
+  bool png = output.size() >= 4 && output.rfind(".png") == output.size() - 4;
+  std::unique_ptr<iml::RowWriter> writer;
+  FILE *raw = nullptr;
+  if (png) {
+    writer.reset(new iml::RowWriter(output, w, h));
+    if (!*writer) {
+      fail("Couldn't create output image.");
+    }
+  } else {
+    raw = fopen(output.c_str(), "wb");
+    if (!raw) {
+      fail("Couldn't create output file.");
+    }
+  }
+
+  std::vector<LABELTYPE> row(w);
+  for (size_t y = 0; y < h; ++y) {
+    if (fread(row.data(), sizeof(LABELTYPE), w, part) != w) {
+      fail("Failed reading temporary label file.");
+    }
+    for (auto &label : row) {
+      label = table[label];
+    }
+
+    if (png) {
+      unsigned char *out = rgba.data();
+      for (size_t x = 0; x < w; ++x) {
+        RGBA c = img_fun(row[x]);
+        out[0] = c.r;
+        out[1] = c.g;
+        out[2] = c.b;
+        out[3] = c.a;
+        out += 4;
+      }
+      writer->write_row(rgba.data());
+    } else if (fwrite(row.data(), sizeof(LABELTYPE), w, raw) != w) {
+      fail("Failed writing output file.");
+    }
+  }
+
+  if (raw) {
+    fclose(raw);
+  }
+  fclose(part);
+  remove(partname.c_str());
+
+  return count;
+}
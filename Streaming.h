@@ -0,0 +1,51 @@
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include "Strategy.h"
+
+/**
+ * Labels pngs that are too large to keep in memory, in horizontal strips.
+ *
+ * The first pass reads a strip at a time, labels it with the given strategy
+ * and relabels it to 1..N, which are offset to be unique over the image.
+ * Only the last row of the previous strip is kept, to merge components across
+ * the seam through an Equivalence, and the provisional labels are written to
+ * a temporary file.  The second pass reads that back a row at a time and
+ * writes the final labels.  Memory thus grows with the strip height and the
+ * number of components, not with the image.
+ */
+class StripLabeler {
+private:
+  Strategy *strategy;
+  size_t strip_height;
+  int connectivity;
+
+  cl::Context *context = nullptr;
+  cl::Program *program = nullptr;
+  cl::CommandQueue *queue = nullptr;
+
+public:
+  /**
+   * The strategy is used for every strip, and is not owned.  The OpenCL
+   * objects are only needed if it is a gpu strategy.
+   */
+  StripLabeler(Strategy *strategy, size_t strip_height, int connectivity = 4,
+               cl::Context *context = nullptr, cl::Program *program = nullptr,
+               cl::CommandQueue *queue = nullptr)
+      : strategy(strategy), strip_height(strip_height),
+        connectivity(connectivity), context(context), program(program),
+        queue(queue){};
+
+  /**
+   * Labels the png at input, thresholded as LabelData does, and returns the
+   * number of components.  Labels are 1..N in raster order as after
+   * Strategy::relabel.  If output ends in .png the labels are written as an
+   * image through img_fun, otherwise as raw LABELTYPE rows.
+   */
+  size_t label(const std::string &input, const std::string &output,
+               bool (*threshold_function)(unsigned char r, unsigned char g,
+                                          unsigned char b, unsigned char a),
+               RGBA (*img_fun)(LABELTYPE in));
+};
+
+#endif /* end of include guard: STREAMING_H */
@@ -0,0 +1,117 @@
+#include "Tuning.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <sys/stat.h>
+
+Tuning::Tuning(cl::Device *device, const std::string &options) {
+  std::string name = device->getInfo<CL_DEVICE_NAME>() + " " + options;
+  for (auto &c : name) {
+    if (!std::isalnum((unsigned char)c)) {
+      c = '_';
+    }
+  }
+  path = "tuning/" + name + ".txt";
+
+  std::ifstream file(path);
+  int x, y;
+  std::string strategy;
+  while (file >> x >> y && std::getline(file >> std::ws, strategy)) {
+    shapes[strategy] = {x, y};
+  }
+}
+
+bool Tuning::get(const std::string &strategy, int *x, int *y) const {
+  auto it = shapes.find(strategy);
+  if (it == shapes.end()) {
+    return false;
+  }
+  *x = it->second.first;
+  *y = it->second.second;
+  return true;
+}
+
+void Tuning::set(const std::string &strategy, int x, int y) {
+  shapes[strategy] = {x, y};
+}
+
+void Tuning::save() const {
+#ifdef __unix__
+  mkdir("tuning", 0777);
+#else
+  mkdir("tuning");
+#endif
+  std::ofstream file(path);
+  for (auto &s : shapes) {
+    file << s.second.first << " " << s.second.second << " " << s.first
+         << std::endl;
+  }
+  if (!file) {
+    std::cerr << "Failed writing " << path << std::endl;
+  }
+}
+
+bool tune(GPUBase *strat, const std::vector<LabelData> &inputs,
+          int connectivity, cl::Context *context, cl::Program *program,
+          cl::CommandQueue *queue, Tuning *tuning) {
+  if (strat->tuned_kernel().empty() || inputs.empty()) {
+    return false;
+  }
+
+  // The limits are per kernel, which needs the program bound first.
+  strat->copy_to(&inputs[0], context, program, queue);
+  strat->execute();
+  strat->copy_from();
+  // recursively_win keeps a stack of 512 entries per work-group.
+  const size_t max = std::min<size_t>(strat->max_work_group(), 512);
+  const size_t multiple =
+      std::min(std::max<size_t>(strat->preferred_multiple(), 1), max);
+  const size_t max_y = strat->tuned_dims() == 2 ? max : 1;
+
+  const int repetitions = 3;
+  double best = 0;
+  int best_x = 0;
+  int best_y = 0;
+  for (size_t x = 1; x <= max; x *= 2) {
+    for (size_t y = 1; y <= max_y && x * y <= max; y *= 2) {
+      if ((x * y) % multiple) {
+        continue;
+      }
+      strat->force_work_group(x, y);
+
+      // Fastest of a few runs of every input, summed.
+      double total = 0;
+      bool valid = true;
+      for (auto &input : inputs) {
+        double fastest = 0;
+        for (int r = 0; r < repetitions && valid; ++r) {
+          strat->copy_to(&input, context, program, queue);
+          auto start = std::chrono::high_resolution_clock::now();
+          strat->execute();
+          auto end = std::chrono::high_resolution_clock::now();
+          LabelData output = strat->copy_from();
+          valid = valid_result(&output, connectivity);
+
+          double us =
+              std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+                  .count();
+          fastest = r ? std::min(fastest, us) : us;
+        }
+        total += fastest;
+      }
+
+      if (valid && (!best_x || total < best)) {
+        best = total;
+        best_x = x;
+        best_y = y;
+      }
+    }
+  }
+
+  strat->force_work_group(0, 0);
+  if (best_x) {
+    tuning->set(strat->name(), best_x, best_y);
+  }
+  return true;
+}
@@ -0,0 +1,50 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Strategy.h"
+
+/**
+ * The best work-group shape of every tunable gpu strategy on one device, as
+ * found by tune.  Kept between runs in tuning/ under the name of the device
+ * and the build options, as the kernels differ with those, one line of x, y
+ * and strategy name each.
+ */
+class Tuning {
+private:
+  std::string path;
+  std::map<std::string, std::pair<int, int>> shapes;
+
+public:
+  /**
+   * Loads the tuning of device with the kernels built with options, if it
+   * has been tuned before.
+   */
+  Tuning(cl::Device *device, const std::string &options);
+
+  /**
+   * The tuned shape of the named strategy into x and y, if there is one.
+   */
+  bool get(const std::string &strategy, int *x, int *y) const;
+  void set(const std::string &strategy, int x, int y);
+
+  /**
+   * Writes the file back.
+   */
+  void save() const;
+};
+
+/**
+ * Times strat with every legal work-group shape on the inputs, and keeps the
+ * fastest in tuning.  The shapes are powers of two, with a size that is a
+ * multiple of the preferred one and within the limit of the kernel.  Shapes
+ * whose labeling fails valid_result are skipped.  Returns false if strat
+ * has nothing to tune.
+ */
+bool tune(GPUBase *strat, const std::vector<LabelData> &inputs,
+          int connectivity, cl::Context *context, cl::Program *program,
+          cl::CommandQueue *queue, Tuning *tuning);
+
+#endif /* end of include guard: TUNING_H */
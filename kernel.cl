@@ -1,4 +1,56 @@
+// Connectivity of the components, 4 or 8.  Built with "-D CONNECTIVITY=8" for
+// 8-connectivity, such that the 4-connected kernels don't pay for it.
+#ifndef CONNECTIVITY
+#define CONNECTIVITY 4
+#endif
+
+// Built with "-D WIDTH=... -D HEIGHT=..." for a single image size, see
+// ProgramVariants.  Every kernel taking w and h starts with FIXED_SIZE(),
+// which then overwrites them with the constants, such that the index
+// arithmetic and bounds checks fold at compile time.  The host must only
+// run such a build on images of that size.
+#ifdef WIDTH
+#define FIXED_SIZE() (w = WIDTH, h = HEIGHT)
+#else
+#define FIXED_SIZE()
+#endif
+
+#if CONNECTIVITY == 8
+// Smallest nonzero label among the diagonal neighbours, 1 << 30 if there are
+// none.
+int diagonal_min(global int *data, int w, int h, int x, int y) {
+  int min = 1 << 30;
+  int tmp;
+  if (y - 1 >= 0 && x - 1 >= 0) {
+    tmp = data[w * (y - 1) + (x - 1)];
+    if (tmp && tmp < min) {
+      min = tmp;
+    }
+  }
+  if (y - 1 >= 0 && x + 1 < w) {
+    tmp = data[w * (y - 1) + (x + 1)];
+    if (tmp && tmp < min) {
+      min = tmp;
+    }
+  }
+  if (y + 1 < h && x - 1 >= 0) {
+    tmp = data[w * (y + 1) + (x - 1)];
+    if (tmp && tmp < min) {
+      min = tmp;
+    }
+  }
+  if (y + 1 < h && x + 1 < w) {
+    tmp = data[w * (y + 1) + (x + 1)];
+    if (tmp && tmp < min) {
+      min = tmp;
+    }
+  }
+  return min;
+}
+#endif
+
 kernel void label_with_id(global int *data, int w, int h) {
+  FIXED_SIZE();
   int x = get_global_id(0);
   int y = get_global_id(1);
   if (x >= w || y >= h) {
@@ -11,14 +63,63 @@ kernel void label_with_id(global int *data, int w, int h) {
   }
 }
 
-kernel void neighbour_propagate(global int *data, int w, int h,
-                                global char *changed) {
+// As label_with_id, but from a mask of a byte per pixel as uploaded by
+// GPUBase::copy_to, also writing the background.
+kernel void label_from_mask(global int *data, int w, int h,
+                            global uchar *mask) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  int loc = w * y + x;
+  data[loc] = mask[loc] ? loc + 2 : 0;
+}
+
+// label_from_mask fused with the first neighbour_propagate.  The neighbours'
+// labels would be their index+2, so the smallest is that of the first
+// foreground neighbour in index order.
+kernel void neighbour_propagate_from_mask(global int *data, int w, int h,
+                                          global uchar *mask) {
+  FIXED_SIZE();
   int x = get_global_id(0);
   int y = get_global_id(1);
   if (x >= w || y >= h) {
     return;
   }
 
+  int loc = w * y + x;
+  if (!mask[loc]) {
+    data[loc] = 0;
+    return;
+  }
+
+  // From the largest index to the smallest.
+  int min = loc;
+  if (x > 0 && mask[loc - 1]) {
+    min = loc - 1;
+  }
+#if CONNECTIVITY == 8
+  if (y > 0 && x + 1 < w && mask[loc - w + 1]) {
+    min = loc - w + 1;
+  }
+#endif
+  if (y > 0 && mask[loc - w]) {
+    min = loc - w;
+  }
+#if CONNECTIVITY == 8
+  if (y > 0 && x > 0 && mask[loc - w - 1]) {
+    min = loc - w - 1;
+  }
+#endif
+  data[loc] = min + 2;
+}
+
+// One neighbour propagation step for the pixel at (x, y).
+void neighbour_propagate_at(global int *data, int w, int h, int x, int y,
+                            global char *changed) {
   int oldlabel = data[w * y + x];
   int curlabel = oldlabel;
   int otherlabel = 0;
@@ -51,6 +152,12 @@ kernel void neighbour_propagate(global int *data, int w, int h,
       curlabel = otherlabel;
     }
   }
+#if CONNECTIVITY == 8
+  otherlabel = diagonal_min(data, w, h, x, y);
+  if (otherlabel < curlabel) {
+    curlabel = otherlabel;
+  }
+#endif
 
   if (curlabel < oldlabel) {
     *changed = 1;
@@ -58,8 +165,21 @@ kernel void neighbour_propagate(global int *data, int w, int h,
   }
 }
 
+kernel void neighbour_propagate(global int *data, int w, int h,
+                                global char *changed) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  neighbour_propagate_at(data, w, h, x, y, changed);
+}
+
 kernel void plus_propagate(global int *data, int w, int h,
                            global char *changed) {
+  FIXED_SIZE();
   int x = get_global_id(0);
   int y = get_global_id(1);
   if (x >= w || y >= h) {
@@ -131,6 +251,13 @@ kernel void plus_propagate(global int *data, int w, int h,
     }
     ++diff;
   }
+#if CONNECTIVITY == 8
+  // Lines are only followed straight, diagonals just one step.
+  otherlabel = diagonal_min(data, w, h, x, y);
+  if (otherlabel < curlabel) {
+    curlabel = otherlabel;
+  }
+#endif
 
   if (curlabel < oldlabel) {
     *changed = 1;
@@ -148,57 +275,90 @@ int find_set(global int *data, int loc) {
   return loc;
 }
 
-kernel void union_find(global int *data, int w, int h, global char *changed) {
-  int x = get_global_id(0);
-  int y = get_global_id(1);
-  if (x >= w || y >= h) {
-    return;
-  }
-
-  int oldlabel = data[w * y + x];
+// One union-find step for the pixel at (x, y) of the w*h image starting at
+// base in data.  Labels are indices into all of data, plus 2.
+void union_find_at(global int *data, int base, int w, int h, int x, int y,
+                   global char *changed) {
+  int oldlabel = data[base + w * y + x];
   int lowest = oldlabel;
 
   if (oldlabel == 0) {
     return;
   }
 
-  bool ok_N = y - 1 >= 0 && data[w * (y - 1) + (x)];
-  bool ok_E = x + 1 < w && data[w * (y) + (x + 1)];
-  bool ok_S = y + 1 < h && data[w * (y + 1) + (x)];
-  bool ok_W = x - 1 >= 0 && data[w * (y) + (x - 1)];
+  bool ok_N = y - 1 >= 0 && data[base + w * (y - 1) + (x)];
+  bool ok_E = x + 1 < w && data[base + w * (y) + (x + 1)];
+  bool ok_S = y + 1 < h && data[base + w * (y + 1) + (x)];
+  bool ok_W = x - 1 >= 0 && data[base + w * (y) + (x - 1)];
   int root_N;
   int root_E;
   int root_S;
   int root_W;
+#if CONNECTIVITY == 8
+  bool ok_NE = y - 1 >= 0 && x + 1 < w && data[base + w * (y - 1) + (x + 1)];
+  bool ok_SE = y + 1 < h && x + 1 < w && data[base + w * (y + 1) + (x + 1)];
+  bool ok_SW = y + 1 < h && x - 1 >= 0 && data[base + w * (y + 1) + (x - 1)];
+  bool ok_NW = y - 1 >= 0 && x - 1 >= 0 && data[base + w * (y - 1) + (x - 1)];
+  int root_NE;
+  int root_SE;
+  int root_SW;
+  int root_NW;
+#endif
 
   if (ok_N) {
-    root_N = find_set(data, w * (y - 1) + (x));
+    root_N = find_set(data, base + w * (y - 1) + (x));
     if (root_N + 2 < lowest) {
       lowest = root_N + 2;
     }
   }
   if (ok_E) {
-    root_E = find_set(data, w * (y) + (x + 1));
+    root_E = find_set(data, base + w * (y) + (x + 1));
     if (root_E + 2 < lowest) {
       lowest = root_E + 2;
     }
   }
   if (ok_S) {
-    root_S = find_set(data, w * (y + 1) + (x));
+    root_S = find_set(data, base + w * (y + 1) + (x));
     if (root_S + 2 < lowest) {
       lowest = root_S + 2;
     }
   }
   if (ok_W) {
-    root_W = find_set(data, w * (y) + (x - 1));
+    root_W = find_set(data, base + w * (y) + (x - 1));
     if (root_W + 2 < lowest) {
       lowest = root_W + 2;
     }
   }
+#if CONNECTIVITY == 8
+  if (ok_NE) {
+    root_NE = find_set(data, base + w * (y - 1) + (x + 1));
+    if (root_NE + 2 < lowest) {
+      lowest = root_NE + 2;
+    }
+  }
+  if (ok_SE) {
+    root_SE = find_set(data, base + w * (y + 1) + (x + 1));
+    if (root_SE + 2 < lowest) {
+      lowest = root_SE + 2;
+    }
+  }
+  if (ok_SW) {
+    root_SW = find_set(data, base + w * (y + 1) + (x - 1));
+    if (root_SW + 2 < lowest) {
+      lowest = root_SW + 2;
+    }
+  }
+  if (ok_NW) {
+    root_NW = find_set(data, base + w * (y - 1) + (x - 1));
+    if (root_NW + 2 < lowest) {
+      lowest = root_NW + 2;
+    }
+  }
+#endif
 
   if (lowest < oldlabel) {
     *changed = 1;
-    data[w * y + x] = lowest;
+    data[base + w * y + x] = lowest;
     if (ok_N && root_N + 2 > lowest) {
       data[root_N] = lowest;
     }
@@ -211,11 +371,277 @@ kernel void union_find(global int *data, int w, int h, global char *changed) {
     if (ok_W && root_W + 2 > lowest) {
       data[root_W] = lowest;
     }
+#if CONNECTIVITY == 8
+    if (ok_NE && root_NE + 2 > lowest) {
+      data[root_NE] = lowest;
+    }
+    if (ok_SE && root_SE + 2 > lowest) {
+      data[root_SE] = lowest;
+    }
+    if (ok_SW && root_SW + 2 > lowest) {
+      data[root_SW] = lowest;
+    }
+    if (ok_NW && root_NW + 2 > lowest) {
+      data[root_NW] = lowest;
+    }
+#endif
+  }
+}
+
+kernel void union_find(global int *data, int w, int h, global char *changed) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  union_find_at(data, 0, w, h, x, y, changed);
+}
+
+// union_find over a batch of count images packed one after another in data,
+// see GPUBatchUnionFind.  images holds offset, width and height of each, and
+// dimension 2 of the range picks the image.  Neighbours are only looked for
+// inside the pixel's own image, so labels never cross into another.
+kernel void batch_union_find(global int *data, global int *images, int count,
+                             global char *changed) {
+  int i = get_global_id(2);
+  if (i >= count) {
+    return;
+  }
+  int base = images[3 * i];
+  int w = images[3 * i + 1];
+  int h = images[3 * i + 2];
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  union_find_at(data, base, w, h, x, y, changed);
+}
+
+// Sparse tiles, see GPUBase::label_init_sparse.  The image is split into
+// tiles of the work-group size, and flags gets whether each holds any
+// foreground, by index in raster order.
+kernel void tile_occupancy(global int *data, int w, int h, global int *flags) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  bool first = get_local_id(0) == 0 && get_local_id(1) == 0;
+  local int occupied;
+
+  if (first) {
+    occupied = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (x < w && y < h && data[w * y + x]) {
+    occupied = 1;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (first) {
+    flags[get_num_groups(0) * get_group_id(1) + get_group_id(0)] = occupied;
+  }
+}
+
+// Writes the index of every occupied tile to tiles, in order, from the
+// scanned flags.
+kernel void tile_compact(global int *flags, int n, global int *tiles) {
+  int i = get_global_id(0);
+  if (i >= n) {
+    return;
+  }
+
+  if (flags[i] != (i ? flags[i - 1] : 0)) {
+    tiles[flags[i] - 1] = i;
+  }
+}
+
+// Where the work-item is in the image, when launched with a work-group per
+// tile in tiles, of the same size as when the list was made.
+int2 sparse_position(global int *tiles, int w) {
+  int tw = get_local_size(0);
+  int th = get_local_size(1);
+  int tile = tiles[get_group_id(0)];
+  int across = (w + tw - 1) / tw;
+  return (int2)(tile % across * tw + get_local_id(0),
+                tile / across * th + get_local_id(1));
+}
+
+// neighbour_propagate over the occupied tiles only.
+kernel void sparse_neighbour_propagate(global int *data, int w, int h,
+                                       global char *changed,
+                                       global int *tiles) {
+  FIXED_SIZE();
+  int2 pos = sparse_position(tiles, w);
+  if (pos.x >= w || pos.y >= h) {
+    return;
+  }
+
+  neighbour_propagate_at(data, w, h, pos.x, pos.y, changed);
+}
+
+// Frontier, see GPUBase::converge_frontier.  As sparse_neighbour_propagate,
+// but flags a change in dirty for the tile instead of in a single flag.
+kernel void frontier_neighbour_propagate(global int *data, int w, int h,
+                                         global char *dirty,
+                                         global int *tiles) {
+  FIXED_SIZE();
+  int2 pos = sparse_position(tiles, w);
+  if (pos.x >= w || pos.y >= h) {
+    return;
+  }
+
+  neighbour_propagate_at(data, w, h, pos.x, pos.y,
+                         &dirty[tiles[get_group_id(0)]]);
+}
+
+kernel void frontier_clear(global char *dirty, int n) {
+  int i = get_global_id(0);
+  if (i < n) {
+    dirty[i] = 0;
+  }
+}
+
+// Flags every occupied tile, by the scanned flags of label_init_sparse, as
+// active when it or any of its neighbours is dirty.  The tiles are across *
+// down in raster order.
+kernel void frontier_expand(global int *occupied, global char *dirty,
+                            int across, int down, global int *active) {
+  int i = get_global_id(0);
+  if (i >= across * down) {
+    return;
+  }
+
+  int tx = i % across;
+  int ty = i / across;
+  int any = 0;
+  if (occupied[i] != (i ? occupied[i - 1] : 0)) {
+    for (int y = max(ty - 1, 0); y <= min(ty + 1, down - 1); ++y) {
+      for (int x = max(tx - 1, 0); x <= min(tx + 1, across - 1); ++x) {
+        if (dirty[across * y + x]) {
+          any = 1;
+        }
+      }
+    }
+  }
+  active[i] = any;
+}
+
+// As tile_compact for the scanned active flags, also clearing dirty for the
+// next iteration.
+kernel void frontier_compact(global int *active, int n, global int *tiles,
+                             global char *dirty) {
+  int i = get_global_id(0);
+  if (i >= n) {
+    return;
+  }
+
+  if (active[i] != (i ? active[i - 1] : 0)) {
+    tiles[active[i] - 1] = i;
+  }
+  dirty[i] = 0;
+}
+
+// union_find over the occupied tiles only.
+kernel void sparse_union_find(global int *data, int w, int h,
+                              global char *changed, global int *tiles) {
+  FIXED_SIZE();
+  int2 pos = sparse_position(tiles, w);
+  if (pos.x >= w || pos.y >= h) {
+    return;
+  }
+
+  union_find_at(data, 0, w, h, pos.x, pos.y, changed);
+}
+
+// Label equivalence, see GPULabelEquivalence.  Every label is the index+2 of
+// a pixel of the same component whose own label is no larger, so following
+// labels always ends at a root, whose label is its own index+2.  The scan
+// hooks the root of every pixel onto the smallest label next to it.
+kernel void equivalence_scan(global int *data, int w, int h,
+                             global char *changed) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  int label = data[w * y + x];
+  int min = label;
+  int otherlabel = 0;
+
+  if (label == 0) {
+    return;
+  }
+
+  if (y + 1 < h) {
+    otherlabel = data[w * (y + 1) + (x)];
+    if (otherlabel && otherlabel < min) {
+      min = otherlabel;
+    }
+  }
+  if (y - 1 >= 0) {
+    otherlabel = data[w * (y - 1) + (x)];
+    if (otherlabel && otherlabel < min) {
+      min = otherlabel;
+    }
+  }
+  if (x + 1 < w) {
+    otherlabel = data[w * (y) + (x + 1)];
+    if (otherlabel && otherlabel < min) {
+      min = otherlabel;
+    }
+  }
+  if (x - 1 >= 0) {
+    otherlabel = data[w * (y) + (x - 1)];
+    if (otherlabel && otherlabel < min) {
+      min = otherlabel;
+    }
+  }
+#if CONNECTIVITY == 8
+  otherlabel = diagonal_min(data, w, h, x, y);
+  if (otherlabel < min) {
+    min = otherlabel;
+  }
+#endif
+
+  if (min < label) {
+    *changed = 1;
+    atomic_min(&data[label - 2], min);
+  }
+}
+
+// Pointer jumping, data[i] = data[data[i] - 2] until it stops changing, such
+// that every pixel holds the root of its label.  A hook found by the scan so
+// reaches the whole of both labels at once instead of a pixel per iteration,
+// and the number of rounds of scan and jump grows roughly with the logarithm
+// of the length of a component rather than with the length itself.
+kernel void equivalence_jump(global int *data, int w, int h) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
   }
+
+  int label = data[w * y + x];
+  if (label == 0) {
+    return;
+  }
+
+  int next = data[label - 2];
+  while (next != label) {
+    label = next;
+    next = data[label - 2];
+  }
+  data[w * y + x] = label;
 }
 
 kernel void lineedit_right(global int *data, int w, int h,
                            global char *changed) {
+  FIXED_SIZE();
   int x = 0;
   int y = get_global_id(0);
   int lowest = 1 << 30;
@@ -230,6 +656,13 @@ kernel void lineedit_right(global int *data, int w, int h,
     if (curlabel == 0) {
       lowest = 1 << 30;
     } else {
+#if CONNECTIVITY == 8
+      // Lines only connect straight, so the diagonals are pulled in as well.
+      int diag = diagonal_min(data, w, h, x, y);
+      if (diag < lowest) {
+        lowest = diag;
+      }
+#endif
       if (curlabel < lowest) {
         lowest = curlabel;
       } else if (curlabel > lowest) {
@@ -244,6 +677,7 @@ kernel void lineedit_right(global int *data, int w, int h,
 
 kernel void lineedit_left(global int *data, int w, int h,
                           global char *changed) {
+  FIXED_SIZE();
   int x = w - 1;
   int y = get_global_id(0);
   int lowest = 1 << 30;
@@ -258,6 +692,13 @@ kernel void lineedit_left(global int *data, int w, int h,
     if (curlabel == 0) {
       lowest = 1 << 30;
     } else {
+#if CONNECTIVITY == 8
+      // Lines only connect straight, so the diagonals are pulled in as well.
+      int diag = diagonal_min(data, w, h, x, y);
+      if (diag < lowest) {
+        lowest = diag;
+      }
+#endif
       if (curlabel < lowest) {
         lowest = curlabel;
       } else if (curlabel > lowest) {
@@ -271,6 +712,7 @@ kernel void lineedit_left(global int *data, int w, int h,
 }
 
 kernel void lineedit_up(global int *data, int w, int h, global char *changed) {
+  FIXED_SIZE();
   int x = get_global_id(0);
   int y = 0;
   int lowest = 1 << 30;
@@ -285,6 +727,13 @@ kernel void lineedit_up(global int *data, int w, int h, global char *changed) {
     if (curlabel == 0) {
       lowest = 1 << 30;
     } else {
+#if CONNECTIVITY == 8
+      // Lines only connect straight, so the diagonals are pulled in as well.
+      int diag = diagonal_min(data, w, h, x, y);
+      if (diag < lowest) {
+        lowest = diag;
+      }
+#endif
       if (curlabel < lowest) {
         lowest = curlabel;
       } else if (curlabel > lowest) {
@@ -299,6 +748,7 @@ kernel void lineedit_up(global int *data, int w, int h, global char *changed) {
 
 kernel void lineedit_down(global int *data, int w, int h,
                           global char *changed) {
+  FIXED_SIZE();
   int x = get_global_id(0);
   int y = h - 1;
   int lowest = 1 << 30;
@@ -313,6 +763,13 @@ kernel void lineedit_down(global int *data, int w, int h,
     if (curlabel == 0) {
       lowest = 1 << 30;
     } else {
+#if CONNECTIVITY == 8
+      // Lines only connect straight, so the diagonals are pulled in as well.
+      int diag = diagonal_min(data, w, h, x, y);
+      if (diag < lowest) {
+        lowest = diag;
+      }
+#endif
       if (curlabel < lowest) {
         lowest = curlabel;
       } else if (curlabel > lowest) {
@@ -326,6 +783,7 @@ kernel void lineedit_down(global int *data, int w, int h,
 }
 
 kernel void lines_up(global int *data, int w, int h, global char *changed) {
+  FIXED_SIZE();
   int x = get_global_id(0);
   int y = 0;
   char localchanged = 0;
@@ -350,6 +808,13 @@ kernel void lines_up(global int *data, int w, int h, global char *changed) {
       if (tmpmin < min) {
         min = tmpmin;
       }
+#if CONNECTIVITY == 8
+      tmpmin = diagonal_min(data, w, h, x, i);
+      if (tmpmin < min) {
+        min = tmpmin;
+        localchanged = 1;
+      }
+#endif
       ++i;
     }
 
@@ -365,6 +830,7 @@ kernel void lines_up(global int *data, int w, int h, global char *changed) {
 }
 
 kernel void lines_right(global int *data, int w, int h, global char *changed) {
+  FIXED_SIZE();
   int x = 0;
   int y = get_global_id(0);
   char localchanged = 0;
@@ -389,6 +855,13 @@ kernel void lines_right(global int *data, int w, int h, global char *changed) {
       if (tmpmin < min) {
         min = tmpmin;
       }
+#if CONNECTIVITY == 8
+      tmpmin = diagonal_min(data, w, h, i, y);
+      if (tmpmin < min) {
+        min = tmpmin;
+        localchanged = 1;
+      }
+#endif
       ++i;
     }
 
@@ -411,11 +884,56 @@ kernel void id_accessor(global int *data, int w) {
   data[loc] = data[loc];
 }
 
-// Can't allocate if not known at compile-time anyway
-#define lw 8
-#define lh 8
+// Can't allocate if not known at compile-time anyway.  The kernels that need
+// work-groups of exactly a tile are marked TILE_KERNEL, from which the host
+// reads the size back, so "-D TILE_W=... -D TILE_H=..." is all it takes to
+// change it.
+#ifndef TILE_W
+#define TILE_W 8
+#endif
+#ifndef TILE_H
+#define TILE_H 8
+#endif
+#define lw TILE_W
+#define lh TILE_H
+#define TILE_KERNEL __attribute__((reqd_work_group_size(lw, lh, 1)))
+
+#if CONNECTIVITY == 8
+// Smallest nonzero label among the diagonal neighbours inside the local
+// buffer, 1 << 30 if there are none.
+int local_diagonal_min(local int *buffer, int lx, int ly) {
+  int min = 1 << 30;
+  int tmp;
+  if (lx > 0 && ly > 0) {
+    tmp = buffer[lw * (ly - 1) + (lx - 1)];
+    if (tmp && tmp < min) {
+      min = tmp;
+    }
+  }
+  if (lx < lw - 1 && ly > 0) {
+    tmp = buffer[lw * (ly - 1) + (lx + 1)];
+    if (tmp && tmp < min) {
+      min = tmp;
+    }
+  }
+  if (lx > 0 && ly < lh - 1) {
+    tmp = buffer[lw * (ly + 1) + (lx - 1)];
+    if (tmp && tmp < min) {
+      min = tmp;
+    }
+  }
+  if (lx < lw - 1 && ly < lh - 1) {
+    tmp = buffer[lw * (ly + 1) + (lx + 1)];
+    if (tmp && tmp < min) {
+      min = tmp;
+    }
+  }
+  return min;
+}
+#endif
 
-kernel void solve_locally_nprop(global int *data, int w, int h) {
+TILE_KERNEL kernel void solve_locally_nprop(global int *data, int w, int h) {
+  FIXED_SIZE();
   int lx = get_local_id(0);
   int ly = get_local_id(1);
   int x = get_global_id(0);
@@ -463,6 +981,12 @@ kernel void solve_locally_nprop(global int *data, int w, int h) {
           min = tmp;
         }
       }
+#if CONNECTIVITY == 8
+      tmp = local_diagonal_min(buffer, lx, ly);
+      if (tmp < min) {
+        min = tmp;
+      }
+#endif
       if (min < buffer[lw * ly + lx]) {
         changed = 1;
         buffer[lw * ly + lx] = min;
@@ -477,7 +1001,8 @@ kernel void solve_locally_nprop(global int *data, int w, int h) {
   }
 }
 
-kernel void solve_locally_plus(global int *data, int w, int h) {
+TILE_KERNEL kernel void solve_locally_plus(global int *data, int w, int h) {
+  FIXED_SIZE();
   int lx = get_local_id(0);
   int ly = get_local_id(1);
   int x = get_global_id(0);
@@ -550,6 +1075,12 @@ kernel void solve_locally_plus(global int *data, int w, int h) {
         }
         ++diff;
       }
+#if CONNECTIVITY == 8
+      tmp = local_diagonal_min(buffer, lx, ly);
+      if (tmp < min) {
+        min = tmp;
+      }
+#endif
       if (min < buffer[lw * ly + lx]) {
         changed = 1;
         buffer[lw * ly + lx] = min;
@@ -564,6 +1095,229 @@ kernel void solve_locally_plus(global int *data, int w, int h) {
   }
 }
 
+// Hybrid labeling, see GPUHybrid.  After solve_locally_plus every tile is
+// labeled on its own, with the smallest index+2 within the tile.  Records
+// every pair of differing labels touching across the right or bottom edge of
+// a tile in pairs, which has room for max of them, for the host to merge.
+void seam_pair(global int *pairs, global int *count, int max, int a, int b) {
+  if (b && b != a) {
+    int i = atomic_inc(count);
+    if (i < max) {
+      pairs[2 * i] = a;
+      pairs[2 * i + 1] = b;
+    }
+  }
+}
+
+kernel void seam_pairs(global int *data, int w, int h, global int *pairs,
+                       global int *count, int max) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  int label = data[w * y + x];
+  if (!label) {
+    return;
+  }
+
+  if (x % lw == lw - 1 && x + 1 < w) {
+    seam_pair(pairs, count, max, label, data[w * y + (x + 1)]);
+#if CONNECTIVITY == 8
+    if (y - 1 >= 0) {
+      seam_pair(pairs, count, max, label, data[w * (y - 1) + (x + 1)]);
+    }
+    if (y + 1 < h) {
+      seam_pair(pairs, count, max, label, data[w * (y + 1) + (x + 1)]);
+    }
+#endif
+  }
+  if (y % lh == lh - 1 && y + 1 < h) {
+    seam_pair(pairs, count, max, label, data[w * (y + 1) + x]);
+#if CONNECTIVITY == 8
+    if (x - 1 >= 0) {
+      seam_pair(pairs, count, max, label, data[w * (y + 1) + (x - 1)]);
+    }
+    if (x + 1 < w) {
+      seam_pair(pairs, count, max, label, data[w * (y + 1) + (x + 1)]);
+    }
+#endif
+  }
+}
+
+// Points the root pixel of every tile label in patches, given as pairs of
+// pixel and label, at the label of its merged component.
+kernel void seam_patch(global int *data, global int *patches, int n) {
+  int i = get_global_id(0);
+  if (i >= n) {
+    return;
+  }
+  data[patches[2 * i]] = patches[2 * i + 1];
+}
+
+// Every pixel takes the label held by the root pixel of its tile label, the
+// final one after seam_patch.  Root pixels of merged components hold their
+// own label, so concurrent updates all write the same value.
+kernel void seam_resolve(global int *data, int w, int h) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  int label = data[w * y + x];
+  if (label) {
+    data[w * y + x] = data[label - 2];
+  }
+}
+
+// Block union-find, see GPUBlockUnionFind.  Links only ever point to a
+// smaller index, which atomic_min keeps true under races, so the trees never
+// get cycles and every root ends up the smallest index of its component.
+int local_find(local int *parent, int i) {
+  while (parent[i] != i) {
+    i = parent[i];
+  }
+  return i;
+}
+
+// Hooks the larger of the roots of a and b onto the smaller.  When another
+// work-item got there first, atomic_min may have replaced its link with ours,
+// so the old link is united in turn, until a root is actually hooked.
+void local_unite(local int *parent, int a, int b) {
+  a = local_find(parent, a);
+  b = local_find(parent, b);
+  while (a != b) {
+    if (a > b) {
+      int tmp = a;
+      a = b;
+      b = tmp;
+    }
+    int old = atomic_min(&parent[b], a);
+    if (old == b) {
+      return;
+    }
+    a = local_find(parent, a);
+    b = local_find(parent, old);
+  }
+}
+
+// As local_unite, over the index+2 labels of data.
+void global_unite(global int *data, int a, int b) {
+  a = find_set(data, a);
+  b = find_set(data, b);
+  while (a != b) {
+    if (a > b) {
+      int tmp = a;
+      a = b;
+      b = tmp;
+    }
+    int old = atomic_min(&data[b], a + 2) - 2;
+    if (old == b) {
+      return;
+    }
+    a = find_set(data, a);
+    b = find_set(data, old);
+  }
+}
+
+// Labels every tile on its own with union-find in local memory, and leaves
+// each pixel pointing straight at the root of its tile label.
+TILE_KERNEL kernel void block_union_find_local(global int *data, int w, int h) {
+  FIXED_SIZE();
+  int lx = get_local_id(0);
+  int ly = get_local_id(1);
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  int li = lw * ly + lx;
+
+  local int parent[lw * lh];
+  bool fg = x < w && y < h && data[w * y + x];
+  parent[li] = fg ? li : -1;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (fg) {
+    if (lx > 0 && parent[li - 1] >= 0) {
+      local_unite(parent, li, li - 1);
+    }
+    if (ly > 0 && parent[li - lw] >= 0) {
+      local_unite(parent, li, li - lw);
+    }
+#if CONNECTIVITY == 8
+    if (lx > 0 && ly > 0 && parent[li - lw - 1] >= 0) {
+      local_unite(parent, li, li - lw - 1);
+    }
+    if (lx < lw - 1 && ly > 0 && parent[li - lw + 1] >= 0) {
+      local_unite(parent, li, li - lw + 1);
+    }
+#endif
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (fg) {
+    int root = local_find(parent, li);
+    int rx = x - lx + root % lw;
+    int ry = y - ly + root / lw;
+    data[w * y + x] = w * ry + rx + 2;
+  }
+}
+
+// Unites the tile labels across the left and top edge of every tile.
+kernel void block_union_find_merge(global int *data, int w, int h) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h || !data[w * y + x]) {
+    return;
+  }
+
+  int loc = w * y + x;
+  if (x % lw == 0 && x > 0) {
+    if (data[loc - 1]) {
+      global_unite(data, loc, loc - 1);
+    }
+#if CONNECTIVITY == 8
+    if (y > 0 && data[loc - w - 1]) {
+      global_unite(data, loc, loc - w - 1);
+    }
+    if (y + 1 < h && data[loc + w - 1]) {
+      global_unite(data, loc, loc + w - 1);
+    }
+#endif
+  }
+  if (y % lh == 0 && y > 0) {
+    if (data[loc - w]) {
+      global_unite(data, loc, loc - w);
+    }
+#if CONNECTIVITY == 8
+    if (x > 0 && data[loc - w - 1]) {
+      global_unite(data, loc, loc - w - 1);
+    }
+    if (x + 1 < w && data[loc - w + 1]) {
+      global_unite(data, loc, loc - w + 1);
+    }
+#endif
+  }
+}
+
+// Points every pixel straight at its root.
+kernel void block_union_find_flatten(global int *data, int w, int h) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  int loc = w * y + x;
+  if (data[loc]) {
+    data[loc] = find_set(data, loc) + 2;
+  }
+}
+
 #define BUFFS 512
 
 #define NORTH (w * (y - 1) + (x))
@@ -578,8 +1332,16 @@ kernel void solve_locally_plus(global int *data, int w, int h) {
 #define OK_WEST (x > 0)
 #define VALID (x < w && y < h)
 
+#if CONNECTIVITY == 8
+#define NORTHEAST (w * (y - 1) + (x + 1))
+#define SOUTHEAST (w * (y + 1) + (x + 1))
+#define SOUTHWEST (w * (y + 1) + (x - 1))
+#define NORTHWEST (w * (y - 1) + (x - 1))
+#endif
+
 kernel void recursively_win(global int *data, int w, int h,
                             global char *changed) {
+  FIXED_SIZE();
   int x, y;
   int lx = get_local_id(0);
   int ly = get_local_id(1);
@@ -620,6 +1382,20 @@ kernel void recursively_win(global int *data, int w, int h,
       if (OK_WEST && data[WEST] > thistmp) {
         eligible = 1;
       }
+#if CONNECTIVITY == 8
+      if (OK_NORTH && OK_EAST && data[NORTHEAST] > thistmp) {
+        eligible = 1;
+      }
+      if (OK_SOUTH && OK_EAST && data[SOUTHEAST] > thistmp) {
+        eligible = 1;
+      }
+      if (OK_SOUTH && OK_WEST && data[SOUTHWEST] > thistmp) {
+        eligible = 1;
+      }
+      if (OK_NORTH && OK_WEST && data[NORTHWEST] > thistmp) {
+        eligible = 1;
+      }
+#endif
 
       if (eligible) {
         atomic_min(lowest, thistmp);
@@ -670,6 +1446,40 @@ kernel void recursively_win(global int *data, int w, int h,
           stack_y[own_pointer] = y;
         }
       }
+#if CONNECTIVITY == 8
+      if (OK_NORTH && OK_EAST) {
+        if (data[NORTHEAST] > thistmp) {
+          data[NORTHEAST] = thistmp;
+          own_pointer = atomic_inc(stack_ptr);
+          stack_x[own_pointer] = x + 1;
+          stack_y[own_pointer] = y - 1;
+        }
+      }
+      if (OK_SOUTH && OK_EAST) {
+        if (data[SOUTHEAST] > thistmp) {
+          data[SOUTHEAST] = thistmp;
+          own_pointer = atomic_inc(stack_ptr);
+          stack_x[own_pointer] = x + 1;
+          stack_y[own_pointer] = y + 1;
+        }
+      }
+      if (OK_SOUTH && OK_WEST) {
+        if (data[SOUTHWEST] > thistmp) {
+          data[SOUTHWEST] = thistmp;
+          own_pointer = atomic_inc(stack_ptr);
+          stack_x[own_pointer] = x - 1;
+          stack_y[own_pointer] = y + 1;
+        }
+      }
+      if (OK_NORTH && OK_WEST) {
+        if (data[NORTHWEST] > thistmp) {
+          data[NORTHWEST] = thistmp;
+          own_pointer = atomic_inc(stack_ptr);
+          stack_x[own_pointer] = x - 1;
+          stack_y[own_pointer] = y - 1;
+        }
+      }
+#endif
     }
 
     thistmp = *lowest; // For unlucky threads to participate
@@ -745,7 +1555,210 @@ kernel void recursively_win(global int *data, int w, int h,
             }
           }
         }
+#if CONNECTIVITY == 8
+        if (OK_NORTH && OK_EAST) {
+          if (data[NORTHEAST] > thistmp) {
+            data[NORTHEAST] = thistmp;
+            own_pointer = atomic_inc(stack_ptr);
+            if (own_pointer >= BUFFS) {
+              atomic_dec(stack_ptr);
+            } else {
+              stack_x[own_pointer] = x + 1;
+              stack_y[own_pointer] = y - 1;
+            }
+          }
+        }
+        if (OK_SOUTH && OK_EAST) {
+          if (data[SOUTHEAST] > thistmp) {
+            data[SOUTHEAST] = thistmp;
+            own_pointer = atomic_inc(stack_ptr);
+            if (own_pointer >= BUFFS) {
+              atomic_dec(stack_ptr);
+            } else {
+              stack_x[own_pointer] = x + 1;
+              stack_y[own_pointer] = y + 1;
+            }
+          }
+        }
+        if (OK_SOUTH && OK_WEST) {
+          if (data[SOUTHWEST] > thistmp) {
+            data[SOUTHWEST] = thistmp;
+            own_pointer = atomic_inc(stack_ptr);
+            if (own_pointer >= BUFFS) {
+              atomic_dec(stack_ptr);
+            } else {
+              stack_x[own_pointer] = x - 1;
+              stack_y[own_pointer] = y + 1;
+            }
+          }
+        }
+        if (OK_NORTH && OK_WEST) {
+          if (data[NORTHWEST] > thistmp) {
+            data[NORTHWEST] = thistmp;
+            own_pointer = atomic_inc(stack_ptr);
+            if (own_pointer >= BUFFS) {
+              atomic_dec(stack_ptr);
+            } else {
+              stack_x[own_pointer] = x - 1;
+              stack_y[own_pointer] = y - 1;
+            }
+          }
+        }
+#endif
       }
     }
   }
 }
+
+// Consecutive relabeling, see GPUBase::relabel.  One work-item per pixel,
+// data seen as a flat array of n pixels.
+
+kernel void relabel_fill(global int *first, int n, int value) {
+  int i = get_global_id(0);
+  if (i < n) {
+    first[i] = value;
+  }
+}
+
+kernel void relabel_first(global int *data, int n, global int *first) {
+  int i = get_global_id(0);
+  if (i >= n) {
+    return;
+  }
+
+  // Only the start of each run can be the first pixel.
+  int label = data[i];
+  if (label && (i == 0 || data[i - 1] != label)) {
+    atomic_min(&first[label], i);
+  }
+}
+
+kernel void relabel_flag(global int *data, int n, global int *first,
+                         global int *flags) {
+  int i = get_global_id(0);
+  if (i >= n) {
+    return;
+  }
+
+  int label = data[i];
+  flags[i] = label && first[label] == i;
+}
+
+kernel void relabel_assign(global int *data, int n, global int *first,
+                           global int *flags) {
+  int i = get_global_id(0);
+  if (i >= n) {
+    return;
+  }
+
+  // The scanned flags step up exactly at the first pixel of every label.
+  int label = data[i];
+  if (label && flags[i] != (i ? flags[i - 1] : 0)) {
+    first[label] = flags[i];
+  }
+}
+
+kernel void relabel_apply(global int *data, int n, global int *first) {
+  int i = get_global_id(0);
+  if (i >= n) {
+    return;
+  }
+
+  int label = data[i];
+  if (label) {
+    data[i] = first[label];
+  }
+}
+
+#define SCAN_WG 256
+
+// Inclusive scan of every block of SCAN_WG ints in local memory, writing the
+// total of each block to sums.
+kernel void scan_block(global int *data, int n, global int *sums) {
+  local int tmp[SCAN_WG];
+  int i = get_global_id(0);
+  int li = get_local_id(0);
+
+  tmp[li] = i < n ? data[i] : 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int offset = 1; offset < SCAN_WG; offset <<= 1) {
+    int add = li >= offset ? tmp[li - offset] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    tmp[li] += add;
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (i < n) {
+    data[i] = tmp[li];
+  }
+  if (li == SCAN_WG - 1) {
+    sums[get_group_id(0)] = tmp[li];
+  }
+}
+
+// Adds the scanned totals of the preceding blocks.
+kernel void scan_add(global int *data, int n, global int *sums) {
+  int i = get_global_id(0);
+  int group = get_group_id(0);
+  if (i >= n || group == 0) {
+    return;
+  }
+
+  data[i] += sums[group - 1];
+}
+
+// Per component statistics, see GPUBase::statistics.  Every component has
+// STATS_FIELDS uints: area, xmin, ymin, xmax, ymax, and the sums of x and y
+// as low and high halves.
+#define STATS_FIELDS 9
+
+kernel void stats_init(global uint *stats, int n) {
+  int i = get_global_id(0);
+  if (i >= n) {
+    return;
+  }
+
+  global uint *s = stats + STATS_FIELDS * i;
+  s[0] = 0;
+  s[1] = UINT_MAX;
+  s[2] = UINT_MAX;
+  s[3] = 0;
+  s[4] = 0;
+  s[5] = 0;
+  s[6] = 0;
+  s[7] = 0;
+  s[8] = 0;
+}
+
+// Adds to the 64 bit sum kept in lo/hi, carrying into hi on overflow.
+void add_carry(global uint *lo, global uint *hi, uint value) {
+  uint old = atomic_add(lo, value);
+  if (old + value < old) {
+    atomic_inc(hi);
+  }
+}
+
+// Expects compact labels, 1..n as left by the relabeling.
+kernel void stats_accumulate(global int *data, int w, int h,
+                             global uint *stats) {
+  FIXED_SIZE();
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+  if (x >= w || y >= h) {
+    return;
+  }
+
+  int label = data[w * y + x];
+  if (!label) {
+    return;
+  }
+
+  global uint *s = stats + STATS_FIELDS * (label - 1);
+  atomic_inc(&s[0]);
+  atomic_min(&s[1], (uint)x);
+  atomic_min(&s[2], (uint)y);
+  atomic_max(&s[3], (uint)x);
+  atomic_max(&s[4], (uint)y);
+  add_carry(&s[5], &s[6], x);
+  add_carry(&s[7], &s[8], y);
+}
@@ -3,25 +3,412 @@
 #include <chrono>
 #include <sys/stat.h>
 #include <algorithm>
+#include <memory>
 
 #include "Image.h"
 #include "Strategy.h"
 #include "LabelData.h"
 #include "RGBAConversions.h"
+#include "Benchmark.h"
+#include "Generators.h"
+#include "MultiDevice.h"
+#include "Pipeline.h"
+#include "Streaming.h"
+#include "Tuning.h"
 #include "utilityCL.h"
 
+/**
+ * Makers of the gpu strategies, as the pipelined mode needs several of each.
+ */
+std::vector<std::function<GPUBase *()>> gpu_strategies() {
+  return {
+      [] { return new GPUNeighbourPropagation; },
+      [] { return new GPUSparseNeighbourPropagation; },
+      [] { return new GPUFrontierNeighbourPropagation; },
+      [] { return new GPUNeighbourPropagation_Localer; },
+      [] { return new GPUUnionFind; },
+      [] { return new GPUSparseUnionFind; },
+      [] { return new GPUUnionFind_Localer; },
+      [] { return new GPULabelEquivalence; },
+      [] { return new GPUPlusPropagation; },
+      [] { return new GPULineEditing; },
+      [] { return new GPULookaheadLineEditing; },
+      [] { return new GPUStackOnePass; },
+      [] { return new GPUHybrid; },
+      [] { return new GPUBlockUnionFind; },
+  };
+}
+
+/**
+ * The cpu strategies for the given connectivity, followed by the gpu ones.
+ * The first is used as the reference labeling.
+ */
+template <int CONN> void add_strategies(std::vector<Strategy *> *strats) {
+  // strats->push_back(new IdStrategy);
+  strats->push_back(new CPUOnePass<CONN>);
+  strats->push_back(new CPUUnionFind<CONN>);
+  strats->push_back(new CPUParallelUnionFind<CONN>);
+  strats->push_back(new CPURunUnionFind<CONN>);
+  strats->push_back(new CPULinearTwoScan<CONN>);
+  strats->push_back(new CPUBlockTwoScan<CONN>);
+  strats->push_back(new CPUFrontBack<CONN>);
+  for (auto &make : gpu_strategies()) {
+    strats->push_back(make());
+  }
+  strats->push_back(new MultiDevice([] { return new GPUUnionFind; }));
+}
+
+/**
+ * Where the labeling of filename by the named strategy is written.
+ */
+std::string output_name(const std::string &filename, const std::string &name) {
+  std::string cleaninput = filename;
+  std::replace(cleaninput.begin(), cleaninput.end(), '/', '-');
+  return "out/" + cleaninput + " - " + name + ".png";
+}
+
+/**
+ * Labels the image in strips of the given height without ever loading it
+ * whole, timing it and writing the result to out/.
+ */
+template <int CONN> void stream(const std::string &filename, size_t strip) {
+  CPURunUnionFind<CONN> strat;
+  StripLabeler labeler(&strat, strip, CONN);
+  std::string name = "Strip-streamed " + strat.name();
+
+  auto start = std::chrono::high_resolution_clock::now();
+  labeler.label(filename, output_name(filename, name), rgb_above_128, mod8);
+  auto end = std::chrono::high_resolution_clock::now();
+
+  auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+                .count();
+  std::cout << std::left << std::setw(32) << filename << " -- "
+            << std::setw(32) << name << " -- " << std::setw(23) << ms
+            << " -- " << ms << std::endl;
+}
+
+/**
+ * The thresholded image, or the generated input if filename is a generator
+ * spec.
+ */
+LabelData load_input(const std::string &filename) {
+  if (gen::is_spec(filename)) {
+    return gen::generate(filename);
+  }
+
+  iml::Image rgba_image(filename);
+  if (!rgba_image) {
+    fail("Image not loaded correctly, aborting.");
+  }
+  return LabelData(&rgba_image, rgb_above_128);
+}
+
+/**
+ * The inputs, all loaded at once.
+ */
+std::vector<LabelData> load_inputs(const std::vector<std::string> &filenames) {
+  std::vector<LabelData> inputs;
+  for (auto &filename : filenames) {
+    inputs.push_back(load_input(filename));
+  }
+  return inputs;
+}
+
+/**
+ * Labels all the images as the frames of a sequence with every gpu strategy,
+ * pipelined, and reports the frames per second.  With variants, the
+ * strategies use the variants for the sizes of the frames.  Whether every
+ * labeling was valid.
+ */
+bool pipelined(const std::vector<std::string> &filenames, int connectivity,
+               cl::Context *context, cl::Device *device, cl::Program *program,
+               ProgramVariants *variants, Tuning *tuning) {
+  std::vector<LabelData> inputs = load_inputs(filenames);
+  std::vector<const LabelData *> frames;
+  for (auto &input : inputs) {
+    frames.push_back(&input);
+    if (variants) {
+      variants->add(input.width, input.height);
+    }
+  }
+
+  bool all_valid = true;
+
+  for (auto &make : gpu_strategies()) {
+    auto tuned = [&] {
+      GPUBase *strat = make();
+      strat->variants = variants;
+      strat->tuning = tuning;
+      return strat;
+    };
+    Pipeline pipeline(tuned, context, device, program);
+
+    bool valid = true;
+    pipeline.run(frames, [&](size_t, const LabelData &labels) {
+      LabelData copy(labels);
+      valid = valid && valid_result(&copy, connectivity);
+    });
+    if (!valid) {
+      std::cerr << "Strategy returned an invalid labeling" << std::endl;
+      all_valid = false;
+    }
+
+    double fps = pipeline.run(frames);
+    std::cout << std::left << std::setw(32)
+              << std::to_string(frames.size()) + " frames" << " -- "
+              << std::setw(32) << "Pipelined " + pipeline.name() << " -- "
+              << fps << " fps" << std::endl;
+  }
+  return all_valid;
+}
+
+/**
+ * Labels all the images in a single batch, and then one by one with the same
+ * union-find for comparison, timing both including the transfers.  Whether
+ * every labeling of the batch was valid.
+ */
+bool batched(const std::vector<std::string> &filenames, int connectivity,
+             cl::Context *context, cl::Program *program,
+             cl::CommandQueue *queue) {
+  std::vector<LabelData> inputs = load_inputs(filenames);
+  std::vector<const LabelData *> batch;
+  for (auto &input : inputs) {
+    batch.push_back(&input);
+  }
+  std::string count = std::to_string(inputs.size()) + " images";
+
+  GPUBatchUnionFind batcher;
+  batcher.copy_to_batch(batch, context, program, queue);
+  batcher.execute();
+  batcher.copy_from_batch();
+
+  auto start = std::chrono::high_resolution_clock::now();
+  batcher.copy_to_batch(batch, context, program, queue);
+  batcher.execute();
+  std::vector<LabelData> outputs = batcher.copy_from_batch();
+  auto end = std::chrono::high_resolution_clock::now();
+  auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+                .count();
+  std::cout << std::left << std::setw(32) << count << " -- " << std::setw(32)
+            << "Batched " + batcher.name() << " -- " << ms << std::endl;
+
+  bool all_valid = true;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    if (!valid_result(&outputs[i], connectivity)) {
+      std::cerr << "Strategy returned an invalid labeling" << std::endl;
+      all_valid = false;
+    }
+    iml::Image out(outputs[i].width, outputs[i].height);
+    outputs[i].copy_to_image(out.data, mod8);
+    if (!iml::writepng(output_name(filenames[i], "Batched " + batcher.name()),
+                       &out)) {
+      std::cerr << "Failed writing file." << std::endl;
+    }
+  }
+
+  GPUUnionFind single;
+  single.copy_to(batch[0], context, program, queue);
+  single.execute();
+  single.copy_from();
+
+  start = std::chrono::high_resolution_clock::now();
+  for (auto *input : batch) {
+    single.copy_to(input, context, program, queue);
+    single.execute();
+    single.copy_from();
+  }
+  end = std::chrono::high_resolution_clock::now();
+  ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+           .count();
+  std::cout << std::left << std::setw(32) << count << " -- " << std::setw(32)
+            << "Separate " + single.name() << " -- " << ms << std::endl;
+  return all_valid;
+}
+
+/**
+ * Times every gpu strategy on each image with the labels copied back and with
+ * them mapped in place, the fastest of the repetitions including the
+ * transfers, to see which of the two suits the device.
+ */
+void transfers(const std::vector<std::string> &filenames,
+               cl::Context *context, cl::Program *program,
+               cl::CommandQueue *queue, int repetitions) {
+  std::vector<LabelData> inputs = load_inputs(filenames);
+  std::vector<std::pair<GPUBase::Transfer, std::string>> modes = {
+      {GPUBase::Transfer::Copy, "Copied "},
+      {GPUBase::Transfer::Map, "Mapped "}};
+
+  for (auto &make : gpu_strategies()) {
+    for (auto &mode : modes) {
+      std::unique_ptr<GPUBase> strat(make());
+      strat->transfer = mode.first;
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        strat->copy_to(&inputs[i], context, program, queue);
+        strat->execute();
+        strat->copy_from();
+
+        long long best = 0;
+        for (int r = 0; r < repetitions; ++r) {
+          auto start = std::chrono::high_resolution_clock::now();
+          strat->copy_to(&inputs[i], context, program, queue);
+          strat->execute();
+          strat->copy_from();
+          auto end = std::chrono::high_resolution_clock::now();
+          long long us =
+              std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+                  .count();
+          best = r ? std::min(best, us) : us;
+        }
+        std::cout << std::left << std::setw(32) << filenames[i] << " -- "
+                  << std::setw(32) << mode.second + strat->name() << " -- "
+                  << best << std::endl;
+      }
+    }
+  }
+}
+
+/**
+ * Tunes the work-group shape of every gpu strategy on the images, saving the
+ * results for later runs.  With variants, the strategies are tuned with the
+ * variants for the sizes of the images.
+ */
+void tune_all(const std::vector<std::string> &filenames, int connectivity,
+              cl::Context *context, cl::Program *program,
+              cl::CommandQueue *queue, ProgramVariants *variants,
+              Tuning *tuning) {
+  std::vector<LabelData> inputs = load_inputs(filenames);
+  if (variants) {
+    for (auto &input : inputs) {
+      variants->add(input.width, input.height);
+    }
+  }
+  for (auto &make : gpu_strategies()) {
+    std::unique_ptr<GPUBase> strat(make());
+    strat->variants = variants;
+    if (!tune(strat.get(), inputs, connectivity, context, program, queue,
+              tuning)) {
+      continue;
+    }
+    int x = 0;
+    int y = 0;
+    tuning->get(strat->name(), &x, &y);
+    std::cout << std::left << std::setw(32) << strat->name() << " -- " << x
+              << "x" << y << std::endl;
+  }
+  tuning->save();
+}
+
+/**
+ * Writes the device side timings of a gpu strategy's last run to stderr,
+ * next to the timings on stdout.
+ */
+void print_profile(const std::string &name, const GPUBase::Profile &p) {
+  std::cerr << name << ": " << p.iterations << " iterations" << std::endl;
+  auto print = [](const char *what,
+                  const std::map<std::string, GPUBase::Profile::Entry> &m) {
+    for (auto &e : m) {
+      std::cerr << "  " << what << " " << std::left << std::setw(32)
+                << e.first << " " << std::setw(6) << e.second.count
+                << " calls " << std::setw(12) << e.second.ms << " ms "
+                << e.second.latency_ms << " ms queued" << std::endl;
+    }
+  };
+  print("kernel  ", p.kernels);
+  print("transfer", p.transfers);
+}
+
 int main(int argc, const char *argv[]) {
-  // Should RVO, want them as locals.
-  cl::Context context = load_context();
-  cl::Device device = load_device(&context);
-  cl::Program program = load_cl_program(&context, &device);
-  cl::CommandQueue queue = load_queue(&context, &device);
+  // Leading options, the rest of the arguments are images.
+  int connectivity = 4;
+  bool relabel = false;
+  bool stats = false;
+  bool blocking = false;
+  bool copy = false;
+  size_t strip = 0;
+  bool pipeline = false;
+  bool batch = false;
+  bool compare_transfers = false;
+  int repetitions = 1;
+  int warmups = 1;
+  Report::Format format = Report::Format::Text;
+  bool quick = false;
+  bool profile = false;
+  bool specialise = false;
+  bool autotune = false;
+  int first = 1;
+  for (; first < argc && argv[first][0] == '-'; ++first) {
+    std::string opt = argv[first];
+    if (opt == "-4") {
+      connectivity = 4;
+    } else if (opt == "-8") {
+      connectivity = 8;
+    } else if (opt == "-r") {
+      relabel = true;
+    } else if (opt == "-s") {
+      stats = true;
+    } else if (opt == "-b") {
+      blocking = true;
+    } else if (opt == "-c") {
+      copy = true;
+    } else if (opt == "-S" && first + 1 < argc) {
+      strip = std::stoul(argv[++first]);
+    } else if (opt == "-p") {
+      pipeline = true;
+    } else if (opt == "-B") {
+      batch = true;
+    } else if (opt == "-M") {
+      compare_transfers = true;
+    } else if (opt == "-n" && first + 1 < argc) {
+      repetitions = std::max(1, std::stoi(argv[++first]));
+    } else if (opt == "-w" && first + 1 < argc) {
+      warmups = std::max(0, std::stoi(argv[++first]));
+    } else if (opt == "-f" && first + 1 < argc) {
+      std::string name = argv[++first];
+      if (name == "csv") {
+        format = Report::Format::CSV;
+      } else if (name == "json") {
+        format = Report::Format::JSON;
+      } else if (name == "text") {
+        format = Report::Format::Text;
+      } else {
+        std::cerr << "Unknown format " << name << std::endl;
+        return 1;
+      }
+    } else if (opt == "-q") {
+      quick = true;
+    } else if (opt == "-P") {
+      profile = true;
+    } else if (opt == "-V") {
+      specialise = true;
+    } else if (opt == "-T") {
+      autotune = true;
+    } else {
+      std::cerr << "Unknown option " << opt << std::endl;
+      return 1;
+    }
+  }
 
-  if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " filename" << std::endl;
+  if (first >= argc) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-4|-8] [-r] [-s] [-b] [-c] [-S rows] [-p] [-B] [-n reps]"
+                 " [-n reps] [-w warmups] [-f text|csv|json] [-q] [-P] [-V]"
+                 " [-T]"
+                 " filename..."
+              << std::endl;
     return 0;
   }
 
+  // Should RVO, want them as locals.
+  cl::Context context = load_context();
+  cl::Device device = load_device(&context);
+  std::string options = "-D CONNECTIVITY=" + std::to_string(connectivity);
+  cl::Program program = load_cl_program(&context, &device, options);
+  ProgramVariants variants(&context, &device, &program, options);
+  // The shapes suit the kernels they were tuned with, and the variants of
+  // all sizes share theirs.
+  Tuning tuning(&device, specialise ? options + " -V" : options);
+  cl::CommandQueue queue = load_queue(&context, &device, profile);
+
   {
 #ifdef __unix__
     int err = mkdir("out", 0777);
@@ -34,85 +421,189 @@ int main(int argc, const char *argv[]) {
     }
   }
 
-  for (int i = 1; i < argc; ++i) {
+  if (autotune) {
+    tune_all(std::vector<std::string>(argv + first, argv + argc), connectivity,
+             &context, &program, &queue, specialise ? &variants : nullptr,
+             &tuning);
+    return 0;
+  }
+
+  if (pipeline) {
+    return pipelined(std::vector<std::string>(argv + first, argv + argc),
+                     connectivity, &context, &device, &program,
+                     specialise ? &variants : nullptr, &tuning)
+               ? 0
+               : 1;
+  }
+
+  if (batch) {
+    return batched(std::vector<std::string>(argv + first, argv + argc),
+                   connectivity, &context, &program, &queue)
+               ? 0
+               : 1;
+  }
+
+  if (compare_transfers) {
+    transfers(std::vector<std::string>(argv + first, argv + argc), &context,
+              &program, &queue, repetitions);
+    return 0;
+  }
+
+  Report report(format);
+  // Whether any strategy got any image wrong, for the exit status.
+  bool failed = false;
+  for (int i = first; i < argc; ++i) {
     std::string filename = argv[i];
 
-    iml::Image rgba_image(filename);
-    if (!rgba_image) {
-      fail("Image not loaded correctly, aborting.");
+    // Generated inputs never were on disk, and are labeled whole.
+    if (strip && !gen::is_spec(filename)) {
+      if (connectivity == 8) {
+        stream<8>(filename, strip);
+      } else {
+        stream<4>(filename, strip);
+      }
+      continue;
     }
 
-    LabelData input(&rgba_image, rgb_above_128);
+    LabelData input = load_input(filename);
+    if (specialise) {
+      variants.add(input.width, input.height);
+    }
 
     std::vector<Strategy *> strats;
-    // strats.push_back(new IdStrategy);
-    strats.push_back(new CPUOnePass);
-    strats.push_back(new CPUUnionFind);
-    strats.push_back(new CPULinearTwoScan);
-    strats.push_back(new CPUFrontBack);
-    strats.push_back(new GPUNeighbourPropagation);
-    strats.push_back(new GPUNeighbourPropagation_Localer);
-    strats.push_back(new GPUUnionFind);
-    strats.push_back(new GPUUnionFind_Localer);
-    strats.push_back(new GPUPlusPropagation);
-    strats.push_back(new GPULineEditing);
-    strats.push_back(new GPULookaheadLineEditing);
-    strats.push_back(new GPUStackOnePass);
-
-    strats[0]->copy_to(&input, &context, &program, &queue);
-    strats[0]->execute();
-    LabelData correct = strats[0]->copy_from();
+    if (connectivity == 8) {
+      add_strategies<8>(&strats);
+    } else {
+      add_strategies<4>(&strats);
+    }
+    for (auto *strat : strats) {
+      if (auto *gpu = dynamic_cast<GPUBase *>(strat)) {
+        if (blocking) {
+          gpu->convergence = GPUBase::Convergence::Blocking;
+        }
+        if (copy) {
+          gpu->transfer = GPUBase::Transfer::Copy;
+        }
+        if (specialise) {
+          gpu->variants = &variants;
+        }
+        gpu->tuning = &tuning;
+      } else if (auto *multi = dynamic_cast<MultiDevice *>(strat)) {
+        if (blocking) {
+          multi->convergence = GPUBase::Convergence::Blocking;
+        }
+        if (copy) {
+          multi->transfer = GPUBase::Transfer::Copy;
+        }
+        multi->specialise = specialise;
+        multi->tuning = &tuning;
+      }
+    }
+
+    // The reference, only needed to validate against.
+    std::vector<ComponentStats> correctstats;
+    size_t components = 0;
+    LabelData correct;
+    if (!quick) {
+      strats[0]->copy_to(&input, &context, &program, &queue);
+      strats[0]->execute();
+      if (stats) {
+        correctstats = strats[0]->statistics();
+        components = correctstats.size();
+      } else if (relabel) {
+        components = strats[0]->relabel();
+      }
+      correct = strats[0]->copy_from();
+    }
 
     // Ensures kernel and queue is ready, as they would only be created once in
     // a usual program.
     for (auto &strat : strats) {
-      // Make warmup not be exactly the same as input for risk of
-      // optimization. A clear image is safe for labeling.
-      LabelData warmup(input);
-      warmup.clear();
+      for (int w = 0; w < warmups; ++w) {
+        // Make warmup not be exactly the same as input for risk of
+        // optimization. A clear image is safe for labeling.
+        LabelData warmup(input);
+        warmup.clear();
 
-      strat->copy_to(&warmup, &context, &program, &queue);
-      strat->execute();
-      strat->copy_from();
+        strat->copy_to(&warmup, &context, &program, &queue);
+        strat->execute();
+        if (stats) {
+          strat->statistics();
+        } else if (relabel) {
+          strat->relabel();
+        }
+        strat->copy_from();
+      }
     }
 
     for (auto *strat : strats) {
-      auto startwithprep = std::chrono::high_resolution_clock::now();
-      strat->copy_to(&input, &context, &program, &queue);
+      std::vector<double> times;
+      std::vector<double> timeswithprep;
+      std::vector<ComponentStats> outstats;
+      size_t outcomponents = 0;
+      LabelData output;
 
-      auto start = std::chrono::high_resolution_clock::now();
-      strat->execute();
-      auto end = std::chrono::high_resolution_clock::now();
+      for (int r = 0; r < repetitions; ++r) {
+        auto startwithprep = std::chrono::high_resolution_clock::now();
+        strat->copy_to(&input, &context, &program, &queue);
 
-      LabelData output = strat->copy_from();
-      auto endwithprep = std::chrono::high_resolution_clock::now();
+        auto start = std::chrono::high_resolution_clock::now();
+        strat->execute();
+        auto end = std::chrono::high_resolution_clock::now();
 
-      auto ms =
-          std::chrono::duration_cast<std::chrono::microseconds>(end - start)
-              .count();
-      auto mswithprep = std::chrono::duration_cast<std::chrono::microseconds>(
-                            endwithprep - startwithprep)
-                            .count();
+        if (stats) {
+          outstats = strat->statistics();
+        } else if (relabel) {
+          outcomponents = strat->relabel();
+        }
+        output = strat->copy_from();
+        auto endwithprep = std::chrono::high_resolution_clock::now();
 
-      std::cout << std::left << std::setw(32) << filename << " -- "
-                << std::setw(32) << strat->name() << " -- " << std::setw(23)
-                << ms << " -- " << mswithprep << std::endl;
+        times.push_back(
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+                .count());
+        timeswithprep.push_back(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                endwithprep - startwithprep)
+                .count());
+      }
 
-      if (!valid_result(&output)) {
+      report.add(filename, strat->name(), input.width * input.height, times,
+                 timeswithprep);
+      if (profile) {
+        if (auto *gpu = dynamic_cast<GPUBase *>(strat)) {
+          print_profile(strat->name(), gpu->profile());
+        }
+      }
+
+      if (quick) {
+        continue;
+      }
+
+      // Only the last repetition is checked, they all did the same.
+      if (stats) {
+        if (!equivalent_stats(correctstats, outstats)) {
+          std::cerr << "Strategy returned unexpected statistics." << std::endl;
+          failed = true;
+        }
+      } else if (relabel && outcomponents != components) {
+        std::cerr << "Strategy found an unexpected number of components."
+                  << std::endl;
+        failed = true;
+      }
+      if (!valid_result(&output, connectivity, relabel || stats)) {
         std::cerr << "Strategy returned an invalid labeling" << std::endl;
+        failed = true;
       }
       if (!equivalent_result(&correct, &output)) {
         std::cerr << "Strategy returned an unexpected labeling." << std::endl;
+        failed = true;
       }
 
       // Write to file
       iml::Image out(output.width, output.height);
       output.copy_to_image(out.data, mod8);
-      std::string cleaninput = filename;
-      std::replace(cleaninput.begin(), cleaninput.end(), '/', '-');
-      std::string outname =
-          "out/" + cleaninput + " - " + strat->name() + ".png";
-      if (!iml::writepng(outname, &out)) {
+      if (!iml::writepng(output_name(filename, strat->name()), &out)) {
         std::cerr << "Failed writing file." << std::endl;
       }
     }
@@ -122,5 +613,5 @@ int main(int argc, const char *argv[]) {
     }
   }
 
-  return 0;
+  return failed ? 1 : 0;
 }
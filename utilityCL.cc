@@ -1,4 +1,7 @@
 #include "utilityCL.h"
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
 
 cl::Context load_context() {
   cl_int err;
@@ -36,7 +39,95 @@ void checkBuildErr(cl_int err, cl::Device *d, cl::Program *p) {
   }
 }
 
-cl::Program load_cl_program(cl::Context *context, cl::Device *device) {
+namespace {
+
+/**
+ * 64 bit FNV-1a.
+ */
+uint64_t fnv1a(const std::string &s) {
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : s) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/**
+ * Where the binary of the program built from source with options for device
+ * is cached.  Anything that changes the binary is part of the name, so a
+ * stale binary is never found rather than having to be detected.
+ */
+std::string cache_name(cl::Device *device, const std::string &source,
+                       const std::string &options) {
+  std::string key = device->getInfo<CL_DEVICE_NAME>() + "\n" +
+                    device->getInfo<CL_DRIVER_VERSION>() + "\n" + options +
+                    "\n" + source;
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)fnv1a(key));
+  return "clcache/" + std::string(name) + ".bin";
+}
+
+/**
+ * The program from the cached binary, if there is one the driver accepts.
+ */
+bool load_cached(cl::Context *context, cl::Device *device,
+                 const std::string &path, const std::string &options,
+                 cl::Program *prog) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  std::vector<char> binary{std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>()};
+
+  cl_int err;
+  cl::Program::Binaries binaries{{binary.data(), binary.size()}};
+  cl::Program cached(*context, {*device}, binaries, nullptr, &err);
+  if (err || cached.build(options.c_str())) {
+    return false;
+  }
+  *prog = cached;
+  return true;
+}
+
+/**
+ * Writes the binary of prog, built for the single device, to path.  Failing
+ * only means the next start compiles again.
+ */
+void store_cached(cl::Program *prog, const std::string &path) {
+  std::vector<size_t> sizes = prog->getInfo<CL_PROGRAM_BINARY_SIZES>();
+  if (sizes.size() != 1 || !sizes[0]) {
+    return;
+  }
+  std::vector<char> binary(sizes[0]);
+  std::vector<char *> binaries{binary.data()};
+  if (prog->getInfo(CL_PROGRAM_BINARIES, &binaries)) {
+    return;
+  }
+
+#ifdef __unix__
+  mkdir("clcache", 0777);
+#else
+  mkdir("clcache");
+#endif
+  // Written aside and renamed, such that a concurrent start never reads half
+  // a binary.
+  std::string tmp = path + "." + std::to_string(getpid());
+  {
+    std::ofstream file(tmp, std::ios::binary);
+    file.write(binary.data(), binary.size());
+    if (!file) {
+      return;
+    }
+  }
+  std::rename(tmp.c_str(), path.c_str());
+}
+
+} // namespace
+
+cl::Program load_cl_program(cl::Context *context, cl::Device *device,
+                            const std::string &options) {
   std::ifstream file("kernel.cl");
   if (!file) {
     fail("Kernel source file not opened correctly");
@@ -44,16 +135,58 @@ cl::Program load_cl_program(cl::Context *context, cl::Device *device) {
   std::string source{std::istreambuf_iterator<char>(file),
                      std::istreambuf_iterator<char>()};
 
+  // A binary is per device, so only a program for a single one is cached.
+  bool cacheable = context->getInfo<CL_CONTEXT_DEVICES>().size() == 1;
+  std::string path;
+  cl::Program prog;
+  if (cacheable) {
+    path = cache_name(device, source, options);
+    if (load_cached(context, device, path, options, &prog)) {
+      return prog;
+    }
+  }
+
   cl_int err;
-  cl::Program prog(*context, source, CL_TRUE, &err);
+  prog = cl::Program(*context, source, false, &err);
+  if (err) {
+    fail("Program could not be created.", err);
+  }
+  err = prog.build(options.c_str());
   checkBuildErr(err, device, &prog);
+  if (cacheable) {
+    store_cached(&prog, path);
+  }
   return prog;
 }
 
-cl::CommandQueue load_queue(cl::Context *context, cl::Device *device) {
+ProgramVariants::ProgramVariants(cl::Context *context, cl::Device *device,
+                                 cl::Program *generic,
+                                 const std::string &options)
+    : context(context), device(device), generic(generic), options(options) {}
+
+void ProgramVariants::add(size_t w, size_t h) { sizes.emplace(w, h); }
+
+cl::Program *ProgramVariants::get(size_t w, size_t h) {
+  auto size = std::make_pair(w, h);
+  if (!sizes.count(size)) {
+    return generic;
+  }
+
+  auto it = built.find(size);
+  if (it == built.end()) {
+    std::string sized = options + " -D WIDTH=" + std::to_string(w) +
+                        " -D HEIGHT=" + std::to_string(h);
+    it = built.emplace(size, load_cl_program(context, device, sized)).first;
+  }
+  return &it->second;
+}
+
+cl::CommandQueue load_queue(cl::Context *context, cl::Device *device,
+                            bool profiling) {
   cl_int err;
 
-  cl::CommandQueue queue(*context, *device, 0, &err);
+  cl::CommandQueue queue(*context, *device,
+                         profiling ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
   if (err) {
     fail("Queue could not be opened correctly.", err);
   }
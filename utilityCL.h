@@ -3,6 +3,8 @@
 
 #include <CL/cl.hpp>
 #include <fstream>
+#include <map>
+#include <set>
 #include "defines.h"
 
 /**
@@ -21,13 +23,51 @@ cl::Device load_device(cl::Context *context);
 void checkBuildErr(cl_int err, cl::Device *d, cl::Program *p);
 
 /**
- * Tries to load the opencl program.
+ * Tries to load the opencl program, built with the given compiler options,
+ * such as "-D CONNECTIVITY=8".  For a context of a single device the binary
+ * is cached in clcache/, keyed by device, driver, options and source, and
+ * later loaded from there instead of compiling again.
  */
-cl::Program load_cl_program(cl::Context *context, cl::Device *device);
+cl::Program load_cl_program(cl::Context *context, cl::Device *device,
+                            const std::string &options = "");
 
 /**
- * Creates a queue.
+ * The program built for fixed image sizes, see FIXED_SIZE in kernel.cl.  Only
+ * the sizes added are specialised, each built on first use and kept, every
+ * other size gets the generic program.
  */
-cl::CommandQueue load_queue(cl::Context *context, cl::Device *device);
+class ProgramVariants {
+private:
+  cl::Context *context;
+  cl::Device *device;
+  cl::Program *generic;
+  std::string options;
+  std::set<std::pair<size_t, size_t>> sizes;
+  std::map<std::pair<size_t, size_t>, cl::Program> built;
+
+public:
+  /**
+   * generic was built with options, which the variants are built with too.
+   */
+  ProgramVariants(cl::Context *context, cl::Device *device,
+                  cl::Program *generic, const std::string &options = "");
+
+  /**
+   * Specialises for images of w*h.
+   */
+  void add(size_t w, size_t h);
+
+  /**
+   * The program to run w*h images with.
+   */
+  cl::Program *get(size_t w, size_t h);
+};
+
+/**
+ * Creates a queue, with CL_QUEUE_PROFILING_ENABLE if profiling, such that the
+ * gpu strategies record the timings of their commands, see GPUBase::profile.
+ */
+cl::CommandQueue load_queue(cl::Context *context, cl::Device *device,
+                            bool profiling = false);
 
 #endif /* end of include guard: UTILITYCL_H */